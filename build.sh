@@ -21,7 +21,7 @@ if [[ $1 == "arduino" ]]; then
         fi
     fi
 else
-    if gcc -Wall -Wextra -Werror -Os -DDEBUG -DEEPROM_SIZE=4096 \
+    if gcc -Wall -Wextra -Werror -Os -DDEBUG -DEEPROM_SIZE=4096 -pthread \
         -Iinclude/ $(find src -name *.c) -o goldos
     then
         if [[ $1 == "disasm" ]]; then
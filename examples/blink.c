@@ -0,0 +1,9 @@
+#include "goldos-dev.h"
+
+void main(void) {
+    for (uint8_t i = 0; i < 10; i++) {
+        serial_write('*');
+        delay(500);
+    }
+    serial_write('\n');
+}
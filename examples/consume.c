@@ -0,0 +1,14 @@
+#include "goldos-dev.h"
+
+void main(void) {
+    int8_t pipe = pipe_open("numbers", PIPE_OPEN_MODE_READ);
+    if (pipe != -1) {
+        char buffer[17];
+        int16_t size;
+        while ((size = pipe_read(pipe, buffer, sizeof(buffer) - 1)) > 0) {
+            buffer[size] = '\0';
+            serial_print(buffer);
+        }
+        pipe_close(pipe);
+    }
+}
@@ -0,0 +1,10 @@
+#include "goldos-dev.h"
+
+void main(void) {
+    for (;;) {
+        char character = serial_read();
+        if (character == 'q') break;
+        serial_write(character);
+    }
+    serial_write('\n');
+}
@@ -1,16 +1,28 @@
 PATH=$PATH:"C:\Program Files (x86)\Arduino\hardware\tools\avr\bin"
+# Programs run on the full ATmega328p instruction set, but get the 128 bytes
+# of guest RAM at 0x60 the processor emulates, set RAM to ask for an other size
+# with a program header
+RAM_SIZE=${RAM:-128}
 if
-    avr-gcc -Os -mmcu=attiny25 $1.c -o $1 \
+    avr-gcc -O2 -mmcu=atmega328p $1.c -o $1 \
+        -Wl,--section-start,.data=0x800060 -Wl,--defsym,__stack=$((0x60 + RAM_SIZE - 1)) \
         -Wl,--defsym,serial_write=2 -Wl,--defsym,serial_print=4 -Wl,--defsym,serial_print_P=6 \
         -Wl,--defsym,serial_println=8 -Wl,--defsym,serial_println_P=10 \
         -Wl,--defsym,file_open=12 -Wl,--defsym,file_name=14 -Wl,--defsym,file_size=16 \
         -Wl,--defsym,file_position=18 -Wl,--defsym,file_seek=20 -Wl,--defsym,file_read=22 \
-        -Wl,--defsym,file_write=24 -Wl,--defsym,file_close=26
+        -Wl,--defsym,file_write=24 -Wl,--defsym,file_close=26 \
+        -Wl,--defsym,serial_available=28 -Wl,--defsym,serial_read=30 -Wl,--defsym,delay=32 \
+        -Wl,--defsym,pipe_open=34 -Wl,--defsym,pipe_read=36 -Wl,--defsym,pipe_write=38 -Wl,--defsym,pipe_close=40
 then
     if [[ $2 == "disasm" ]]; then
         avr-size $1
         avr-objdump -S $1 > $1.s
     fi
     avr-objcopy -O binary -R .eeprom $1 $1.prg
+    if [[ -n $RAM ]]; then
+        printf "\\xff\\xff\\x$(printf %02x $((RAM & 0xff)))\\x$(printf %02x $((RAM >> 8)))" | cat - $1.prg > $1.tmp
+        mv $1.tmp $1.prg
+    fi
+    avr-nm -n $1 > $1.sym
     rm $1
 fi
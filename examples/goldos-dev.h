@@ -38,3 +38,28 @@ extern int16_t file_read(int8_t file, uint8_t *buffer, int16_t size);
 extern int16_t file_write(int8_t file, uint8_t *buffer, int16_t size);
 
 extern bool file_close(int8_t file);
+
+// Event API, a process that waits for input or time does not run
+
+extern uint8_t serial_available(void);
+
+// In a pipeline the input of a program is the output of the one before it,
+// serial_read returns -1 when that program closed
+extern char serial_read(void);
+
+extern void delay(uint16_t milliseconds);
+
+// Pipe API, a process that reads an empty pipe or writes a full one waits.
+// A write returns when all bytes are written, a read returns the bytes that
+// are there or 0 when all writers closed the pipe
+
+#define PIPE_OPEN_MODE_READ 0
+#define PIPE_OPEN_MODE_WRITE 1
+
+extern int8_t pipe_open(char *name, uint8_t mode);
+
+extern int16_t pipe_read(int8_t pipe, uint8_t *buffer, int16_t size);
+
+extern int16_t pipe_write(int8_t pipe, uint8_t *buffer, int16_t size);
+
+extern bool pipe_close(int8_t pipe);
@@ -0,0 +1,14 @@
+#include "goldos-dev.h"
+
+void main(void) {
+    int8_t pipe = pipe_open("numbers", PIPE_OPEN_MODE_WRITE);
+    if (pipe != -1) {
+        char string[8];
+        for (uint8_t i = 1; i <= 100; i++) {
+            itoa(i, string, 10);
+            strcat(string, "\n");
+            pipe_write(pipe, string, -1);
+        }
+        pipe_close(pipe);
+    }
+}
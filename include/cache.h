@@ -0,0 +1,39 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The file system reads and writes the EEPROM through a few lines in RAM, a
+// line is written back when it is evicted or the cache is synced
+#ifdef ARDUINO
+    #define CACHE_LINES 4
+    #define CACHE_LINE_SIZE 8
+#else
+    #define CACHE_LINES 16
+    #define CACHE_LINE_SIZE 32
+#endif
+
+typedef struct CacheLine {
+    uint16_t address;
+    bool valid;
+    bool dirty;
+    uint16_t used; // The clock of the last use
+    uint8_t data[CACHE_LINE_SIZE];
+} CacheLine;
+
+extern CacheLine cache_lines[];
+
+uint8_t cache_read_byte(uint16_t address);
+
+void cache_write_byte(uint16_t address, uint8_t byte);
+
+uint16_t cache_read_word(uint16_t address);
+
+void cache_write_word(uint16_t address, uint16_t word);
+
+bool cache_flush(void);
+
+void cache_sync(void);
+
+#endif
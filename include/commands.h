@@ -8,7 +8,11 @@ typedef struct Command {
     void (*command_function)(uint8_t argc, char **argv);
 } Command;
 
-#define COMMANDS_SIZE 43
+#ifdef ARDUINO
+    #define COMMANDS_SIZE 52
+#else
+    #define COMMANDS_SIZE 54
+#endif
 
 extern const Command commands[];
 
@@ -37,6 +41,8 @@ void eeprom_command(uint8_t argc, char **argv);
 // Disk command
 void disk_command(uint8_t argc, char **argv);
 
+void sync_command(uint8_t argc, char **argv);
+
 // File commands
 void read_command(uint8_t argc, char **argv);
 
@@ -59,6 +65,8 @@ void stack_command(uint8_t argc, char **argv);
 void heap_command(uint8_t argc, char **argv);
 
 // Processor commands
+void job_start(uint8_t argc, char **argv);
+
 void run_command(uint8_t argc, char **argv);
 
 void debug_command(uint8_t argc, char **argv);
@@ -71,8 +79,36 @@ void wait_command(uint8_t argc, char **argv);
 
 void stop_command(uint8_t argc, char **argv);
 
+void jobs_command(uint8_t argc, char **argv);
+
+void fg_command(uint8_t argc, char **argv);
+
+void bg_command(uint8_t argc, char **argv);
+
 void niceness_command(uint8_t argc, char **argv);
 
+void quantum_command(uint8_t argc, char **argv);
+
 void process_list_command(uint8_t argc, char **argv);
 
+// The milliseconds between the refreshes of top
+#define TOP_INTERVAL 1000
+
+void top_command(uint8_t argc, char **argv);
+
+void checkpoint_command(uint8_t argc, char **argv);
+
+void resume_command(uint8_t argc, char **argv);
+
+void trace_command(uint8_t argc, char **argv);
+
+#ifndef ARDUINO
+    #define PROFILE_TOP_SIZE 10
+    #define PROFILE_SYMBOL_SIZE 32
+
+    void profile_command(uint8_t argc, char **argv);
+
+    void workers_command(uint8_t argc, char **argv);
+#endif
+
 #endif
@@ -2,16 +2,64 @@
 #define DISK_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "eeprom.h"
 
-#define DISK_BLOCK_ALIGN 8
+// GOLDFS v2 starts with a superblock, then a directory table with an entry
+// per file, then a bitmap of the used blocks and then the data blocks
+#define DISK_VERSION 2
 
-#define DISK_HEADER_SIZE DISK_BLOCK_ALIGN
+#define DISK_HEADER_SIZE 16
 #define DISK_HEADER_SIGNATURE 0
 #define DISK_HEADER_VERSION 7
+#define DISK_HEADER_BLOCK_SIZE 8
+#define DISK_HEADER_DIRECTORY_SIZE 9
+#define DISK_HEADER_BLOCKS 10
+
+#define DISK_BLOCK_SIZE 16
+
+#define DISK_DIRECTORY DISK_HEADER_SIZE
+#define DISK_DIRECTORY_SIZE (EEPROM_SIZE / 64)
+
+// A directory entry holds the flags, the hash of the name, the first block,
+// the size and the number of blocks of the first extent of a file. An extent
+// is a run of blocks, the first one starts with the length of the name and
+// the name. When the file goes on after an extent its last four bytes are the
+// first block and the number of blocks of the next extent
+#define DISK_ENTRY_SIZE 8
+#define DISK_ENTRY_FLAGS 0
+#define DISK_ENTRY_HASH 1
+#define DISK_ENTRY_BLOCK 2
+#define DISK_ENTRY_FILE_SIZE 4
+#define DISK_ENTRY_BLOCKS 6
+
+#define DISK_ENTRY_USED 1
+
+#define DISK_ENTRY(entry) (DISK_DIRECTORY + (entry) * DISK_ENTRY_SIZE)
+
+#define DISK_LINK_SIZE 4
+
+#define DISK_BITMAP (DISK_DIRECTORY + DISK_DIRECTORY_SIZE * DISK_ENTRY_SIZE)
+#define DISK_BITMAP_SIZE (EEPROM_SIZE / DISK_BLOCK_SIZE / 8)
+
+#define DISK_DATA ((DISK_BITMAP + DISK_BITMAP_SIZE + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE * DISK_BLOCK_SIZE)
+#define DISK_BLOCKS ((EEPROM_SIZE - DISK_DATA) / DISK_BLOCK_SIZE)
+
+#define DISK_BLOCK_ADDRESS(block) (DISK_DATA + (block) * DISK_BLOCK_SIZE)
+#define DISK_ADDRESS_BLOCK(address) (((address) - DISK_DATA) / DISK_BLOCK_SIZE)
+
+// The disk is not used when it has an unknown layout
+extern bool disk_ready;
+
+uint8_t disk_hash(char *name);
+
+void disk_begin(void);
 
 uint16_t disk_alloc(uint16_t size);
 
-void disk_free(uint16_t address);
+bool disk_grow(uint16_t address, uint16_t size, uint16_t new_size);
+
+void disk_free(uint16_t address, uint16_t size);
 
 void disk_format(void);
 
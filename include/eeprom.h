@@ -7,6 +7,12 @@
     #define EEPROM_SIZE 1
 #endif
 
+// On the device a write is queued and the EEPROM ready interrupt programs
+// the bytes in the background, a byte takes about 3.3 ms
+#ifdef ARDUINO
+    #define EEPROM_QUEUE_SIZE 16
+#endif
+
 #ifndef ARDUINO
     void eeprom_begin(void);
 
@@ -21,6 +27,12 @@ uint16_t eeprom_read_word(uint16_t address);
 
 void eeprom_write_word(uint16_t address, uint16_t word);
 
+uint8_t eeprom_pending(void);
+
+uint8_t eeprom_available(void);
+
+void eeprom_sync(void);
+
 void eeprom_dump(void);
 
 #endif
@@ -3,24 +3,48 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "disk.h"
 
 typedef struct File {
     uint16_t address;
     uint8_t name_size;
     uint16_t size;
     uint16_t position;
+    uint8_t mode; // The mode the file was opened with
+    uint8_t entry; // The directory entry of the file
+    uint16_t extent; // The extent of the last position and where it starts
+    uint16_t extent_start;
+    uint16_t extent_link; // 0 for the first extent
 } File;
 
-#define FILE_SIZE 8
+// The extents make an open file 15 bytes, so the device has fewer of them
+#ifdef ARDUINO
+    #define FILE_SIZE 6
+#else
+    #define FILE_SIZE 8
+#endif
 extern File files[];
 
+// The directory is kept in RAM so a file is found by the hash of its name
+// without reading the names of the other files from the disk
+typedef struct FileEntry {
+    uint16_t address; // 0 when the entry is free
+    uint16_t size;
+    uint8_t hash;
+} FileEntry;
+
+#define FILE_INDEX_SIZE DISK_DIRECTORY_SIZE
+extern FileEntry files_index[];
+
 #define FILE_OPEN_MODE_READ 0
 #define FILE_OPEN_MODE_WRITE 1
 #define FILE_OPEN_MODE_APPEND 2
 
+void file_begin(void);
+
 int8_t file_open(char *name, uint8_t mode);
 
-bool file_name(int8_t file, char *buffer);
+bool file_name(int8_t file, char *buffer, uint16_t size);
 
 int16_t file_size(int8_t file);
 
@@ -28,6 +52,8 @@ int16_t file_position(int8_t file);
 
 bool file_seek(int8_t file, int16_t position);
 
+uint16_t file_data(int8_t file);
+
 int16_t file_read(int8_t file, uint8_t *buffer, int16_t size);
 
 int16_t file_write(int8_t file, uint8_t *buffer, int16_t size);
@@ -0,0 +1,60 @@
+#ifndef PIPE_H
+#define PIPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A pipe is a named ring buffer in RAM that the processes read and write
+// without touching the EEPROM
+#ifdef ARDUINO
+    #define PIPE_SIZE 2
+    #define PIPE_BUFFER_SIZE 16
+#else
+    #define PIPE_SIZE 8
+    #define PIPE_BUFFER_SIZE 256
+#endif
+
+#define PIPE_NAME_SIZE 8
+
+#define PIPE_OPEN_MODE_READ 0
+#define PIPE_OPEN_MODE_WRITE 1
+
+// Returned by pipe_read and pipe_write when the process must wait
+#define PIPE_BLOCKED -2
+
+struct Processor;
+
+typedef struct Pipe {
+    char name[PIPE_NAME_SIZE];
+    uint8_t readers;
+    uint8_t writers;
+    bool closed; // The last writer closed it, reading the rest ends with 0
+    bool broken; // The last reader closed it, writing fails
+    uint16_t position;
+    uint16_t size;
+    uint8_t buffer[PIPE_BUFFER_SIZE];
+    // A reader that waits on an empty pipe gets the next write copied into
+    // its buffer directly and takes the size when its read runs again
+    struct Processor *reader;
+    uint8_t *reader_buffer;
+    uint16_t reader_size;
+    int16_t transferred;
+} Pipe;
+
+extern Pipe pipes[];
+
+int8_t pipe_open(char *name, uint8_t mode);
+
+int8_t pipe_create(void);
+
+int16_t pipe_read(int8_t pipe, struct Processor *reader, uint8_t *buffer, int16_t size);
+
+int16_t pipe_write(int8_t pipe, uint8_t *buffer, int16_t size);
+
+uint8_t pipe_available(int8_t pipe);
+
+bool pipe_pending(int8_t pipe, struct Processor *processor, uint8_t mode);
+
+bool pipe_close(int8_t pipe, struct Processor *processor, uint8_t mode);
+
+#endif
@@ -7,21 +7,139 @@
 
 typedef enum ProcessState {
     PROCESS_STATE_RUNNING,
-    PROCESS_STATE_SLEEPING
+    PROCESS_STATE_SLEEPING,
+    PROCESS_STATE_BLOCKED
 } ProcessState;
 
+// A scheduler list links processes by their pid, -1 ends the list
+typedef struct ProcessList {
+    int8_t head;
+    int8_t tail;
+} ProcessList;
+
+// The processes that run the same program share its image, it holds the
+// file of the program and on the host its decoded instructions
+typedef struct ProcessImage {
+    int8_t file;
+    uint8_t references;
+    #ifndef ARDUINO
+        ProcessorImage processor;
+    #endif
+} ProcessImage;
+
 typedef struct Process {
     uint8_t niceness;
     int8_t file;
+    int8_t image;
     ProcessState state;
+    ProcessList *list; // The scheduler list the process is in
+    int8_t next;
+    int8_t previous;
+    uint32_t wake; // The time a timer event happens in milliseconds
+    uint32_t started;
+    uint8_t job; // The shell job the process belongs to, 0 for none
+    #ifndef ARDUINO
+        ProcessorState event; // Why a worker queued the process for the kernel
+    #endif
     Processor processor;
 } Process;
 
-#define PROCESSES_SIZE 3
+// The host build can run more processes at the same time than fit in the
+// RAM of the device, both can be changed with -DPROCESSES_SIZE
+#ifndef PROCESSES_SIZE
+    #ifdef ARDUINO
+        #define PROCESSES_SIZE 3
+    #else
+        #define PROCESSES_SIZE 16
+    #endif
+#endif
+
+// The RAM of the guest programs is taken from one pool, so programs that
+// need little RAM leave room for more processes and the host build can run
+// programs with kilobytes of RAM, it can be changed with -DPROCESSES_MEMORY.
+// On the device every process fits with the default RAM size
+#ifndef PROCESSES_MEMORY
+    #ifdef ARDUINO
+        #define PROCESSES_MEMORY (PROCESSES_SIZE * PROCESSOR_RAM_SIZE)
+    #else
+        #define PROCESSES_MEMORY 32768
+    #endif
+#endif
+
+#if PROCESSES_MEMORY > 0xffff - PROCESSOR_RAM_START
+    #error "The RAM of a program must fit in the data space"
+#endif
+
+// A program can start with a header that asks for a RAM size, the magic is
+// not a valid instruction so a program without header is never mistaken
+#define PROCESS_HEADER_MAGIC 0xffff
+#define PROCESS_HEADER_SIZE 4
+
+#if PROCESSES_SIZE > 127
+    #error "A pid must fit in an int8_t"
+#endif
+
+#define PROCESS_NICENESS_MAX 10
+
+// A process runs for as many quanta in a row as its niceness, a quantum
+// ends on the next tick of a timer or after a number of cycles
+#define PROCESSES_QUANTUM 4000 // Microseconds
+
+// The number of cycles a process runs between checks of the timer tick
+#define PROCESS_TICK_CYCLES 256
+
+// The number of cycles a waited on process runs between checks of its state
+#define PROCESS_WAIT_CYCLES 4096
+
+// The key that stops a waited on process and the job it belongs to
+#define PROCESS_STOP_KEY 0x1a // Ctrl+Z
+
+// The longest file name a checkpoint can hold
+#define PROCESS_NAME_SIZE 32
+
+#define PROCESS_CHECKPOINT_MAGIC "GCK\x01"
+
+#ifndef ARDUINO
+    // The host build can run the processes on worker threads, a worker runs a
+    // process for this many cycles per niceness level at a time
+    #define PROCESSES_WORKERS_MAX 16
+
+    #define PROCESS_WORKER_CYCLES 4096
+#endif
+
+typedef struct ProcessStats {
+    uint32_t cycles;
+    uint32_t instructions;
+    uint8_t ipc; // Instructions per 100 cycles
+    uint32_t runtime; // Milliseconds on the device
+    uint32_t syscalls;
+    uint32_t bytes_read; // Through file_read
+    uint32_t bytes_written; // Through file_write
+    uint16_t stack; // The peak stack depth in bytes
+    uint16_t ram; // The RAM size in bytes
+    uint32_t wall; // Milliseconds since it was started
+} ProcessStats;
 
 extern Process processes[PROCESSES_SIZE];
 
-int8_t process_open(char *name, bool debug);
+extern ProcessImage processes_images[PROCESSES_SIZE];
+
+extern volatile bool processes_tick;
+
+extern uint16_t processes_quantum_size;
+
+extern bool processes_quantum_cycles;
+
+void processes_begin(void);
+
+bool processes_quantum(uint16_t size, bool cycles);
+
+uint32_t processes_millis(void);
+
+// Reports events that can wake blocked processes, called by the interrupts
+void processes_event(uint8_t events);
+
+int8_t process_open(char *name, bool debug, uint16_t ram_size);
 
 bool process_sleep(int8_t process);
 
@@ -29,10 +147,36 @@ bool process_wake(int8_t process);
 
 bool process_niceness(int8_t process, uint8_t niceness);
 
+bool process_jit(int8_t process, bool jit);
+
+bool process_trace(int8_t process, bool trace);
+
+bool process_profile(int8_t process, bool profile);
+
+bool process_stats(int8_t process, ProcessStats *stats);
+
 bool process_wait(int8_t process);
 
+bool process_pipe(int8_t process, int8_t next);
+
 bool process_close(int8_t process);
 
+bool process_checkpoint(int8_t process, char *name);
+
+int8_t process_resume(char *name);
+
+void processes_invalidate(uint16_t address);
+
 void processes_run(void);
 
+void processes_yield(void);
+
+#ifndef ARDUINO
+    void processes_kernel_run(void);
+
+    bool processes_workers(uint8_t size);
+
+    extern uint8_t processes_workers_size;
+#endif
+
 #endif
@@ -3,12 +3,171 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "eeprom.h"
+
+typedef enum ProcessorState {
+    PROCESSOR_STATE_NORMAL = 0,
+    PROCESSOR_STATE_CALL,
+    PROCESSOR_STATE_RETURN,
+    PROCESSOR_STATE_HALTED,
+    PROCESSOR_STATE_UNKOWN_INSTRUCTION,
+    PROCESSOR_STATE_BREAK,
+    PROCESSOR_STATE_SYSCALL,
+    PROCESSOR_STATE_BLOCKED
+} ProcessorState;
+
+typedef struct Instruction {
+    uint8_t opcode;
+    uint8_t d;
+    uint8_t r;
+    int16_t k;
+} Instruction;
+
+struct Processor;
+
+// The trace ring holds the last executed instructions of the traced
+// processes without formatting them, it is decoded by the trace command
+#ifdef ARDUINO
+    #define PROCESSOR_TRACE_SIZE 8
+#else
+    #define PROCESSOR_TRACE_SIZE 4096
+#endif
+
+#define PROCESSOR_TRACE_READ 0b00000001
+#define PROCESSOR_TRACE_WRITE 0b00000010
+#define PROCESSOR_TRACE_SYSCALL 0b00000100
+
+typedef struct ProcessorTrace {
+    uint8_t pid; // The process that executed the instruction
+    uint16_t pc;
+    uint16_t instruction;
+    uint8_t flags;
+    uint8_t reg; // The destination register or 0xff
+    uint8_t reg_data;
+    uint8_t data;
+    uint16_t address;
+} ProcessorTrace;
+
+extern ProcessorTrace processor_trace[];
+
+extern uint16_t processor_trace_position;
+
+extern uint16_t processor_trace_size;
+
+// The emulated ATmega328p runs at 16 MHz, the cycle counts of the guest
+// programs are converted to on device run times with it
+#define PROCESSOR_FREQUENCY 16000000UL
+
+// The guest RAM starts after the I/O registers at 0x60, a program gets the
+// default size unless it asks for more or less
+#define PROCESSOR_RAM_START (0x20 + 0x40)
+#define PROCESSOR_RAM_SIZE 128
+
+// A syscall vector is charged like the ret instruction it ends with
+#define PROCESSOR_SYSCALL_CYCLES 4
+
+// The syscall vectors are the even program addresses from 2 up to this one
+#define PROCESSOR_SYSCALL_LAST 40
+#define PROCESSOR_SYSCALLS_SIZE (PROCESSOR_SYSCALL_LAST / 2)
+
+// The events a blocked program waits for
+#define PROCESSOR_EVENT_SERIAL 0b00000001
+#define PROCESSOR_EVENT_TIMER 0b00000010
+#define PROCESSOR_EVENT_PIPE_READ 0b00000100
+#define PROCESSOR_EVENT_PIPE_WRITE 0b00001000
+#define PROCESSOR_EVENT_EEPROM 0b00010000
+
+// The status register bits
+#define PROCESSOR_FLAG_C 0
+#define PROCESSOR_FLAG_Z 1
+#define PROCESSOR_FLAG_N 2
+#define PROCESSOR_FLAG_V 3
+#define PROCESSOR_FLAG_S 4
+#define PROCESSOR_FLAG_H 5
+#define PROCESSOR_FLAG_T 6
+#define PROCESSOR_FLAG_I 7
+
+// The instruction classes the profiler counts, syscall vectors are counted
+// as a class of their own
+#define PROCESSOR_CLASS_ARITHMETIC 0
+#define PROCESSOR_CLASS_BRANCH 1
+#define PROCESSOR_CLASS_TRANSFER 2
+#define PROCESSOR_CLASS_BIT 3
+#define PROCESSOR_CLASS_SYSCALL 4
+#define PROCESSOR_CLASSES_SIZE 5
+
+#ifndef ARDUINO
+    // A translated block is a run of straight-line instructions with their
+    // handlers already bound, ending at the first instruction that can branch
+    #define PROCESSOR_BLOCK_SIZE 16
+    #define PROCESSOR_BLOCKS_SIZE 512
+
+    typedef struct ProcessorOperation {
+        ProcessorState (*handler)(struct Processor *p, Instruction *in);
+        Instruction in;
+    } ProcessorOperation;
+
+    typedef struct ProcessorBlock {
+        uint8_t size;
+        uint8_t cycles;
+        ProcessorOperation operations[PROCESSOR_BLOCK_SIZE];
+    } ProcessorBlock;
+
+    // The program words are decoded and the blocks are translated once per
+    // program image, which the processes that run the same program share. A
+    // slot is claimed by the first processor that needs it and not replaced
+    // until the image is cleared, so the workers fill and read it without a
+    // lock, a processor that finds a slot busy decodes the word itself. The
+    // block index has a slot for every word, the blocks are taken from a pool
+    // and a program with more blocks interprets the words that get none
+    #define PROCESSOR_IMAGE_SIZE (EEPROM_SIZE / 2)
+
+    #define PROCESSOR_IMAGE_EMPTY 0
+    #define PROCESSOR_IMAGE_BUSY 1
+    #define PROCESSOR_IMAGE_READY 2
+
+    #define PROCESSOR_BLOCK_EMPTY 0xffff
+    #define PROCESSOR_BLOCK_NONE 0xfffe
+    #define PROCESSOR_BLOCK_BUSY 0xfffd
+
+    typedef struct ProcessorImage {
+        uint8_t decoded[PROCESSOR_IMAGE_SIZE];
+        Instruction instructions[PROCESSOR_IMAGE_SIZE];
+        uint16_t block_index[PROCESSOR_IMAGE_SIZE]; // The block that starts at a word
+        uint16_t blocks_size;
+        ProcessorBlock blocks[PROCESSOR_BLOCKS_SIZE];
+    } ProcessorImage;
+
+    // The profiler counts how often every program word is executed, a
+    // program can not be bigger than the EEPROM it is stored in
+    #define PROCESSOR_PROFILE_SIZE (EEPROM_SIZE / 2)
+
+    typedef struct ProcessorProfile {
+        uint32_t instructions;
+        uint32_t classes[PROCESSOR_CLASSES_SIZE];
+        uint32_t counts[PROCESSOR_PROFILE_SIZE];
+    } ProcessorProfile;
+
+    extern ProcessorProfile processor_profile;
+#endif
 
 typedef struct Processor {
     bool running;
     bool debug;
+    bool trace;
+    uint8_t pid; // The process slot, stored in the trace entries
     uint16_t pc;
-    uint8_t r[32];
+    // The registers and the I/O registers are laid out like the start of
+    // the AVR data space, so a data address below the RAM indexes it directly
+    union {
+        uint8_t data[PROCESSOR_RAM_START];
+        struct {
+            uint8_t r[32];
+            uint8_t io[64];
+        };
+    };
+    uint8_t *ram; // The RAM at PROCESSOR_RAM_START, owned by the kernel
+    uint16_t ram_size;
     uint16_t sp;
     union {
         struct {
@@ -23,38 +182,80 @@ typedef struct Processor {
         } flags;
         uint8_t data;
     } sreg;
-    uint8_t ram[128];
+    // The arithmetic flags are not computed when an instruction executes,
+    // only its operands are stored and the pending sreg bits are computed
+    // from them when something reads them
+    struct {
+        uint8_t pending;
+        uint16_t result;
+        uint8_t half;
+        bool zero;
+    } lazy;
     uint16_t pgm_address;
-    uint32_t clock_ticks;
+    uint32_t cycles;
+    uint32_t instructions;
+    uint8_t events; // The events the program is blocked on
+    uint16_t delay; // The milliseconds of a timer event
+    // The accounting of the program, syscalls are counted by vector
+    uint16_t syscalls[PROCESSOR_SYSCALLS_SIZE];
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+    uint16_t stack_low; // The lowest address the stack pointer reached
+    uint8_t files; // The files the program opened, a bit per file
+    uint8_t pipes_read; // The pipes the program opened, a bit per pipe
+    uint8_t pipes_write;
+    int8_t pipe; // The pipe a blocked program waits on
+    uint16_t pipe_written; // The bytes a blocked pipe_write or file_write wrote already
+    int8_t input; // The pipes of the serial API in a pipeline, -1 is the serial port
+    int8_t output;
+    #ifndef ARDUINO
+        ProcessorImage *image; // The shared decoded program, or NULL
+        bool jit;
+        bool profile;
+    #endif
 } Processor;
 
-void processor_init(Processor *p, bool debug, uint16_t pgm_address);
+void processor_begin(void);
+
+void processor_init(Processor *p, bool debug, uint16_t pgm_address, uint8_t *ram, uint16_t ram_size);
+
+#ifndef ARDUINO
+    void processor_image_clear(ProcessorImage *image);
+#endif
+
+void processor_trace_clear(void);
+
+ProcessorTrace *processor_trace_get(uint16_t index);
+
+void processor_trace_print(ProcessorTrace *trace);
+
+#ifndef ARDUINO
+    void processor_profile_clear(void);
+#endif
 
 uint8_t processor_read(Processor *p, uint16_t addr);
 
 void processor_write(Processor *p, uint16_t addr, uint8_t data);
 
-void processor_flags(Processor *p, uint8_t data, bool sub_zero_carry, bool overflow);
+void processor_flags(Processor *p, uint8_t mask, uint16_t result, uint8_t half, bool zero_carry);
 
-bool processor_add(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c);
+bool processor_flag(Processor *p, uint8_t flag);
 
-void processor_add_with_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c);
+bool processor_carry(Processor *p);
 
-void processor_add_with_half_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c);
+void processor_flags_update(Processor *p);
 
-bool processor_sub(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c, bool zero_carry);
+uint8_t processor_add(Processor *p, uint8_t a, uint8_t b, bool carry, uint8_t mask);
 
-void processor_sub_with_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c, bool zero_carry);
+uint8_t processor_sub(Processor *p, uint8_t a, uint8_t b, bool carry, uint8_t mask, bool zero_carry);
 
-void processor_sub_with_half_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c, bool zero_carry);
+void processor_decode(uint16_t i, Instruction *in);
 
-typedef enum ProcessorState {
-    PROCESSOR_STATE_NORMAL = 0,
-    PROCESSOR_STATE_CALL,
-    PROCESSOR_STATE_RETURN,
-    PROCESSOR_STATE_HALTED,
-    PROCESSOR_STATE_UNKOWN_INSTRUCTION
-} ProcessorState;
+ProcessorState processor_execute(Processor *p, Instruction *in);
+
+ProcessorState processor_syscall(Processor *p);
+
+ProcessorState processor_run(Processor *p, uint32_t max_cycles);
 
 ProcessorState processor_clock(Processor *p);
 
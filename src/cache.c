@@ -0,0 +1,89 @@
+#include "cache.h"
+#include "eeprom.h"
+
+CacheLine cache_lines[CACHE_LINES];
+
+static uint16_t cache_clock = 0;
+
+static void cache_write_back(CacheLine *line) {
+    if (line->dirty) {
+        // The driver skips the bytes that did not change
+        for (uint8_t i = 0; i < CACHE_LINE_SIZE; i++) {
+            eeprom_write_byte(line->address + i, line->data[i]);
+        }
+        line->dirty = false;
+    }
+}
+
+// Returns the line of an address, the least recently used clean line or
+// else dirty line is written back and filled from the EEPROM when it is not
+// cached. A dirty line waits for the EEPROM when the queue is full
+static CacheLine *cache_line(uint16_t address) {
+    uint16_t line_address = address - address % CACHE_LINE_SIZE;
+    CacheLine *line = &cache_lines[0];
+    for (uint8_t i = 0; i < CACHE_LINES; i++) {
+        if (cache_lines[i].valid && cache_lines[i].address == line_address) {
+            line = &cache_lines[i];
+            line->used = cache_clock++;
+            return line;
+        }
+        if (
+            !cache_lines[i].valid ||
+            (line->valid && line->dirty && !cache_lines[i].dirty) ||
+            (line->valid && line->dirty == cache_lines[i].dirty && (uint16_t)(cache_clock - cache_lines[i].used) > (uint16_t)(cache_clock - line->used))
+        ) {
+            line = &cache_lines[i];
+        }
+    }
+
+    cache_write_back(line);
+    line->address = line_address;
+    line->valid = true;
+    for (uint8_t i = 0; i < CACHE_LINE_SIZE; i++) {
+        line->data[i] = eeprom_read_byte(line_address + i);
+    }
+    line->used = cache_clock++;
+    return line;
+}
+
+uint8_t cache_read_byte(uint16_t address) {
+    return cache_line(address)->data[address % CACHE_LINE_SIZE];
+}
+
+void cache_write_byte(uint16_t address, uint8_t byte) {
+    CacheLine *line = cache_line(address);
+    if (line->data[address % CACHE_LINE_SIZE] != byte) {
+        line->data[address % CACHE_LINE_SIZE] = byte;
+        line->dirty = true;
+    }
+}
+
+uint16_t cache_read_word(uint16_t address) {
+    return cache_read_byte(address) | (cache_read_byte(address + 1) << 8);
+}
+
+void cache_write_word(uint16_t address, uint16_t word) {
+    cache_write_byte(address, word & 0xff);
+    cache_write_byte(address + 1, word >> 8);
+}
+
+// Writes back the dirty lines that fit in the EEPROM queue without waiting,
+// returns false when dirty lines are left
+bool cache_flush(void) {
+    for (uint8_t i = 0; i < CACHE_LINES; i++) {
+        if (cache_lines[i].dirty) {
+            if (eeprom_available() < CACHE_LINE_SIZE) return false;
+            cache_write_back(&cache_lines[i]);
+        }
+    }
+    return true;
+}
+
+// Writes the dirty lines back and empties the cache, so the EEPROM can be
+// read and written without it
+void cache_sync(void) {
+    for (uint8_t i = 0; i < CACHE_LINES; i++) {
+        cache_write_back(&cache_lines[i]);
+        cache_lines[i].valid = false;
+    }
+}
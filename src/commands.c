@@ -10,6 +10,7 @@
 #include "utils.h"
 #include "serial.h"
 #include "eeprom.h"
+#include "cache.h"
 #include "disk.h"
 #include "file.h"
 #include "stack.h"
@@ -33,6 +34,7 @@ const PROGMEM char pause_command_name[] = "pause";
 const PROGMEM char eeprom_command_name[] = "eeprom";
 
 const PROGMEM char disk_command_name[] = "disk";
+const PROGMEM char sync_command_name[] = "sync";
 
 const PROGMEM char read_command_name[] = "read";
 const PROGMEM char cat_command_name[] = "cat";
@@ -62,9 +64,21 @@ const PROGMEM char wake_command_name[] = "wake";
 const PROGMEM char wait_command_name[] = "wait";
 const PROGMEM char stop_command_name[] = "stop";
 const PROGMEM char kill_command_name[] = "kill";
+const PROGMEM char jobs_command_name[] = "jobs";
+const PROGMEM char fg_command_name[] = "fg";
+const PROGMEM char bg_command_name[] = "bg";
 const PROGMEM char niceness_command_name[] = "niceness";
 const PROGMEM char nice_command_name[] = "nice";
+const PROGMEM char quantum_command_name[] = "quantum";
 const PROGMEM char ps_command_name[] = "ps";
+const PROGMEM char top_command_name[] = "top";
+const PROGMEM char checkpoint_command_name[] = "checkpoint";
+const PROGMEM char resume_command_name[] = "resume";
+const PROGMEM char trace_command_name[] = "trace";
+#ifndef ARDUINO
+    const PROGMEM char profile_command_name[] = "profile";
+    const PROGMEM char workers_command_name[] = "workers";
+#endif
 
 const Command commands[] PROGMEM = {
     { random_command_name, &random_command }, { rand_command_name, &random_command },
@@ -80,6 +94,7 @@ const Command commands[] PROGMEM = {
     { eeprom_command_name, &eeprom_command },
 
     { disk_command_name, &disk_command },
+    { sync_command_name, &sync_command },
 
     { read_command_name, &read_command }, { cat_command_name, &read_command },
     { hex_command_name, &hex_command }, { hd_command_name, &hex_command },
@@ -99,8 +114,20 @@ const Command commands[] PROGMEM = {
     { wake_command_name, &wake_command },
     { wait_command_name, &wait_command },
     { stop_command_name, &stop_command }, { kill_command_name, &stop_command },
+    { jobs_command_name, &jobs_command },
+    { fg_command_name, &fg_command },
+    { bg_command_name, &bg_command },
     { niceness_command_name, &niceness_command }, { nice_command_name, &niceness_command },
-    { ps_command_name, &process_list_command }
+    { quantum_command_name, &quantum_command },
+    { ps_command_name, &process_list_command },
+    { top_command_name, &top_command },
+    { checkpoint_command_name, &checkpoint_command },
+    { resume_command_name, &resume_command },
+    { trace_command_name, &trace_command },
+    #ifndef ARDUINO
+        { profile_command_name, &profile_command },
+        { workers_command_name, &workers_command }
+    #endif
 };
 
 // Util commands
@@ -174,6 +201,8 @@ void exit_command(uint8_t argc, char **argv) {
     (void)argc;
     (void)argv;
 
+    cache_sync();
+    eeprom_sync();
     #ifdef ARDUINO
         wdt_enable(WDTO_15MS);
         for (;;);
@@ -199,13 +228,16 @@ void pause_command(uint8_t argc, char **argv) {
     (void)argc;
     (void)argv;
     serial_print_P(PSTR("Press any key to continue..."));
-    while (serial_available() == 0);
+    while (serial_available() == 0) processes_run();
     serial_read();
     serial_write('\n');
 }
 
 // EEPROM command
 void eeprom_command(uint8_t argc, char **argv) {
+    // The EEPROM is used without the cache of the file system
+    cache_sync();
+
     if (argc >= 2) {
         if (!strcmp_P(argv[1], PSTR("write")) && argc >= 3) {
             uint8_t position = 0;
@@ -246,9 +278,9 @@ void disk_command(uint8_t argc, char **argv) {
             if (count == 0) count = 1;
             uint16_t address = disk_alloc(count);
             if (address != 0) {
-                eeprom_write_byte(address, '\0');
+                cache_write_byte(address, '\0');
                 for (uint16_t i = 1; i < count; i++) {
-                    eeprom_write_byte(address + i, argv[3][0]);
+                    cache_write_byte(address + i, argv[3][0]);
                 }
 
                 serial_print_P(PSTR("Address: "));
@@ -259,16 +291,18 @@ void disk_command(uint8_t argc, char **argv) {
             }
         }
 
-        if (!strcmp_P(argv[1], PSTR("free")) && argc >= 3) {
+        if (!strcmp_P(argv[1], PSTR("free")) && argc >= 4) {
             uint16_t address = strtol(argv[2], NULL, 16);
-            disk_free(address);
+            disk_free(address, strtol(argv[3], NULL, 10));
         }
 
         if (!strcmp_P(argv[1], PSTR("format"))) {
             disk_format();
+            file_begin();
         }
 
         if (!strcmp_P(argv[1], PSTR("dump"))) {
+            cache_sync();
             eeprom_dump();
         }
 
@@ -276,10 +310,17 @@ void disk_command(uint8_t argc, char **argv) {
             disk_inspect();
         }
     } else {
-        serial_println_P(PSTR("Help: disk alloc [count] [char], disk free [address], [count] [char], disk format, disk dump, disk inspect / list"));
+        serial_println_P(PSTR("Help: disk alloc [count] [char], disk free [address] [count], disk format, disk dump, disk inspect / list"));
     }
 }
 
+void sync_command(uint8_t argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    cache_sync();
+    eeprom_sync();
+}
+
 // File commands
 const PROGMEM char file_open_error[] = "File open error!";
 const PROGMEM char file_write_error[] = "File write error!";
@@ -294,6 +335,7 @@ void read_command(uint8_t argc, char **argv) {
                 while ((bytes_read = file_read(file, (uint8_t *)buffer, sizeof(buffer) - 1)) != 0) {
                     buffer[bytes_read] = '\0';
                     serial_print(buffer);
+                    processes_yield();
                 }
                 file_close(file);
             } else {
@@ -353,6 +395,7 @@ void hex_command(uint8_t argc, char **argv) {
                         serial_write(character);
                         serial_write(x == 15 ? '\n' : ' ');
                     }
+                    processes_yield();
                 }
 
                 file_close(file);
@@ -673,25 +716,105 @@ void heap_command(uint8_t argc, char **argv) {
 // Processor commands
 const PROGMEM char process_open_error[] = "Process open error!";
 
-void run_command(uint8_t argc, char **argv) {
-    if (argc >= 2) {
-        int8_t process = process_open(argv[1], false);
-        if (process != -1) {
-            if (argc >= 3 && !strcmp_P(argv[2], PSTR("&"))) {
+// Returns the smallest job number no process has
+static uint8_t job_free(void) {
+    for (uint8_t job = 1;; job++) {
+        bool used = false;
+        for (int8_t i = 0; i < PROCESSES_SIZE; i++) {
+            if (processes[i].niceness != 0 && processes[i].job == job) used = true;
+        }
+        if (!used) return job;
+    }
+}
+
+static void job_close(uint8_t job) {
+    for (int8_t i = 0; i < PROCESSES_SIZE; i++) {
+        if (processes[i].niceness != 0 && processes[i].job == job) process_close(i);
+    }
+}
+
+// Waits until the processes of a job are closed, the stop key stops them all
+static void job_wait(uint8_t job) {
+    for (int8_t i = 0; i < PROCESSES_SIZE; i++) {
+        if (processes[i].niceness != 0 && processes[i].job == job) {
+            process_wait(i);
+            if (processes[i].niceness != 0) {
+                for (int8_t j = 0; j < PROCESSES_SIZE; j++) {
+                    if (processes[j].niceness != 0 && processes[j].job == job) process_sleep(j);
+                }
+                printf_P(PSTR("\nJob %d stopped\n"), job);
                 return;
             }
-            process_wait(process);
-        } else {
+        }
+    }
+}
+
+void job_start(uint8_t argc, char **argv) {
+    // A trailing & runs the job in the background
+    bool background = argc >= 2 && !strcmp_P(argv[argc - 1], PSTR("&"));
+    if (background) argc--;
+
+    uint8_t job = job_free();
+    int8_t previous = -1;
+    uint8_t stage = 0;
+    for (;;) {
+        uint8_t end = stage;
+        while (end < argc && strcmp_P(argv[end], PSTR("|"))) end++;
+        if (end > stage && (!strcmp_P(argv[stage], PSTR("run")) || !strcmp_P(argv[stage], PSTR("start")))) stage++;
+        if (stage == end) {
+            job_close(job);
+            serial_println_P(PSTR("Help: run [name] --ram [size]? --jit? --trace? (| [name] ...)... &?"));
+            return;
+        }
+
+        // The RAM size is needed to open the process, zero uses the size of
+        // the program header or the default
+        uint16_t ram_size = 0;
+        for (uint8_t i = stage + 1; i < end - 1; i++) {
+            if (!strcmp_P(argv[i], PSTR("--ram"))) ram_size = strtol(argv[i + 1], NULL, 10);
+        }
+
+        int8_t process = process_open(argv[stage], false, ram_size);
+        if (process == -1) {
+            job_close(job);
             serial_println_P(process_open_error);
+            return;
+        }
+        processes[process].job = job;
+        for (uint8_t i = stage + 1; i < end; i++) {
+            if (!strcmp_P(argv[i], PSTR("--jit")) && !process_jit(process, true)) {
+                serial_println_P(PSTR("Process jit error!"));
+            }
+            if (!strcmp_P(argv[i], PSTR("--trace"))) {
+                process_trace(process, true);
+            }
         }
+
+        // The stages are connected before the shell runs any of them
+        if (previous != -1 && !process_pipe(previous, process)) {
+            job_close(job);
+            serial_println_P(PSTR("Process pipe error!"));
+            return;
+        }
+        previous = process;
+        if (end == argc) break;
+        stage = end + 1;
+    }
+
+    if (!background) job_wait(job);
+}
+
+void run_command(uint8_t argc, char **argv) {
+    if (argc >= 2) {
+        job_start(argc - 1, argv + 1);
     } else {
-        serial_println_P(PSTR("Help: run [name] &?"));
+        serial_println_P(PSTR("Help: run [name] --ram [size]? --jit? --trace? (| [name] ...)... &?"));
     }
 }
 
 void debug_command(uint8_t argc, char **argv) {
     if (argc >= 2) {
-        int8_t process = process_open(argv[1], true);
+        int8_t process = process_open(argv[1], true, 0);
         if (process != -1) {
             if (argc >= 3 && !strcmp_P(argv[2], PSTR("&"))) {
                 return;
@@ -753,6 +876,64 @@ void stop_command(uint8_t argc, char **argv) {
     }
 }
 
+void jobs_command(uint8_t argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    // Every job has a process so the job numbers fit in the process table
+    for (uint8_t job = 1; job <= PROCESSES_SIZE; job++) {
+        bool found = false;
+        bool stopped = true;
+        for (int8_t i = 0; i < PROCESSES_SIZE; i++) {
+            if (processes[i].niceness != 0 && processes[i].job == job) {
+                if (!found) printf_P(PSTR("[%d]"), job);
+                printf_P(PSTR(" %d"), i);
+                if (processes[i].state != PROCESS_STATE_SLEEPING) stopped = false;
+                found = true;
+            }
+        }
+        if (found) serial_println_P(stopped ? PSTR(" stopped") : PSTR(" running"));
+    }
+}
+
+// Returns the job given or the last job, 0 when it does not exist
+static uint8_t job_find(uint8_t argc, char **argv) {
+    uint8_t job = argc >= 2 ? strtol(argv[1], NULL, 10) : 0;
+    uint8_t found = 0;
+    for (int8_t i = 0; i < PROCESSES_SIZE; i++) {
+        if (processes[i].niceness != 0 && processes[i].job != 0) {
+            if (processes[i].job == job) return job;
+            if (argc < 2 && processes[i].job > found) found = processes[i].job;
+        }
+    }
+    return found;
+}
+
+static void job_wake(uint8_t job) {
+    for (int8_t i = 0; i < PROCESSES_SIZE; i++) {
+        if (processes[i].niceness != 0 && processes[i].job == job) process_wake(i);
+    }
+}
+
+void fg_command(uint8_t argc, char **argv) {
+    uint8_t job = job_find(argc, argv);
+    if (job != 0) {
+        job_wake(job);
+        job_wait(job);
+    } else {
+        serial_println_P(PSTR("Job fg error!"));
+    }
+}
+
+void bg_command(uint8_t argc, char **argv) {
+    uint8_t job = job_find(argc, argv);
+    if (job != 0) {
+        job_wake(job);
+    } else {
+        serial_println_P(PSTR("Job bg error!"));
+    }
+}
+
 void niceness_command(uint8_t argc, char **argv) {
     if (argc >= 3) {
         for (uint8_t i = 1; i < argc; i += 2) {
@@ -766,9 +947,39 @@ void niceness_command(uint8_t argc, char **argv) {
     }
 }
 
+void quantum_command(uint8_t argc, char **argv) {
+    if (argc >= 2) {
+        bool cycles = argc >= 3 && !strcmp_P(argv[2], PSTR("--cycles"));
+        if (!processes_quantum(strtol(argv[1], NULL, 10), cycles)) {
+            serial_println_P(PSTR("Quantum error!"));
+        }
+    } else {
+        printf_P(PSTR("Quantum: %u %" PRIpstr "\n"), processes_quantum_size,
+            processes_quantum_cycles ? PSTR("cycles") : PSTR("microseconds"));
+        serial_println_P(PSTR("Help: quantum [size] --cycles?"));
+    }
+}
+
+static void process_state_print(int8_t process) {
+    if (processes[process].state == PROCESS_STATE_RUNNING) {
+        serial_print_P(PSTR("running"));
+    }
+    if (processes[process].state == PROCESS_STATE_SLEEPING) {
+        serial_print_P(PSTR("sleeping"));
+    }
+    if (processes[process].state == PROCESS_STATE_BLOCKED) {
+        serial_print_P(PSTR("blocked"));
+    }
+}
+
 void process_list_command(uint8_t argc, char **argv) {
-    (void)argc;
-    (void)argv;
+    bool long_format = argc >= 2 && !strcmp_P(argv[1], PSTR("-l"));
+    const char *syscall_names[PROCESSOR_SYSCALLS_SIZE] = { PSTR("serial_write"), PSTR("serial_print"),
+        PSTR("serial_print_P"), PSTR("serial_println"), PSTR("serial_println_P"), PSTR("file_open"),
+        PSTR("file_name"), PSTR("file_size"), PSTR("file_position"), PSTR("file_seek"), PSTR("file_read"),
+        PSTR("file_write"), PSTR("file_close"), PSTR("serial_available"), PSTR("serial_read"), PSTR("delay"),
+        PSTR("pipe_open"), PSTR("pipe_read"), PSTR("pipe_write"), PSTR("pipe_close") };
+
     serial_println_P(PSTR("Processes:"));
     bool empty = true;
     for (uint8_t i = 0; i < PROCESSES_SIZE; i++) {
@@ -779,19 +990,278 @@ void process_list_command(uint8_t argc, char **argv) {
             serial_print_P(PSTR(": "));
             serial_print_number(processes[i].niceness, '\0');
             serial_print_P(PSTR(" niceness "));
-            if (processes[i].state == PROCESS_STATE_RUNNING) {
-                serial_print_P(PSTR("running"));
-            }
-            if (processes[i].state == PROCESS_STATE_SLEEPING) {
-                serial_print_P(PSTR("sleeping"));
-            }
+            process_state_print(i);
+            ProcessStats stats;
+            process_stats(i, &stats);
+            printf_P(PSTR(" %lu cycles %lu instructions %u.%02u IPC %lu ms"), (unsigned long)stats.cycles,
+                (unsigned long)stats.instructions, stats.ipc / 100, stats.ipc % 100, (unsigned long)stats.runtime);
             if (processes[i].processor.debug) {
                 serial_print_P(PSTR(" [DEBUG]"));
             }
+            if (processes[i].processor.trace) {
+                serial_print_P(PSTR(" [TRACE]"));
+            }
+            #ifndef ARDUINO
+                if (processes[i].processor.jit) {
+                    serial_print_P(PSTR(" [JIT]"));
+                }
+            #endif
             serial_write('\n');
+
+            if (long_format) {
+                // A name that does not fit is shown cut
+                char name[PROCESS_NAME_SIZE];
+                bool whole = file_name(processes[i].file, name, sizeof(name));
+                if (name[0] != '\0') {
+                    serial_print_P(PSTR("  file: "));
+                    serial_print(name);
+                    if (!whole) serial_print_P(PSTR("..."));
+                    serial_write('\n');
+                }
+                printf_P(PSTR("  wall: %lu ms, stack: %u/%u bytes, read: %lu bytes, written: %lu bytes\n"),
+                    (unsigned long)stats.wall, stats.stack, stats.ram, (unsigned long)stats.bytes_read, (unsigned long)stats.bytes_written);
+                printf_P(PSTR("  syscalls: %lu"), (unsigned long)stats.syscalls);
+                for (uint8_t j = 0; j < PROCESSOR_SYSCALLS_SIZE; j++) {
+                    if (processes[i].processor.syscalls[j] != 0) {
+                        printf_P(PSTR(", %" PRIpstr " %u"), syscall_names[j], processes[i].processor.syscalls[j]);
+                    }
+                }
+                serial_write('\n');
+            }
         }
     }
     if (empty) {
         serial_println_P(PSTR("- No processes active"));
     }
 }
+
+// Shows the processes sorted by the cycles they used since the last refresh
+// until a key is pressed, the processes keep running in between
+void top_command(uint8_t argc, char **argv) {
+    uint16_t interval = argc >= 2 ? strtol(argv[1], NULL, 10) : TOP_INTERVAL;
+    uint32_t last_cycles[PROCESSES_SIZE];
+    for (uint8_t i = 0; i < PROCESSES_SIZE; i++) last_cycles[i] = processes[i].processor.cycles;
+
+    for (;;) {
+        uint32_t start = processes_millis();
+        while (processes_millis() - start < interval) {
+            if (serial_available() != 0) {
+                serial_read();
+                return;
+            }
+            processes_run();
+        }
+
+        ProcessStats stats[PROCESSES_SIZE];
+        uint32_t used[PROCESSES_SIZE];
+        bool shown[PROCESSES_SIZE];
+        uint32_t total = 0;
+        for (uint8_t i = 0; i < PROCESSES_SIZE; i++) {
+            shown[i] = !process_stats(i, &stats[i]);
+            if (!shown[i]) {
+                // A pid that was reused starts counting again
+                used[i] = stats[i].cycles >= last_cycles[i] ? stats[i].cycles - last_cycles[i] : stats[i].cycles;
+                last_cycles[i] = stats[i].cycles;
+                total += used[i];
+            } else {
+                last_cycles[i] = 0;
+            }
+        }
+
+        serial_print_P(PSTR("\x1b[2J\x1b[;H"));
+        serial_println_P(PSTR("PID NICE STATE     CPU%     CYCLES SYSCALLS STACK     WALL"));
+        for (;;) {
+            int8_t busiest = -1;
+            for (uint8_t i = 0; i < PROCESSES_SIZE; i++) {
+                if (!shown[i] && (busiest == -1 || used[i] > used[busiest])) busiest = i;
+            }
+            if (busiest == -1) break;
+            shown[busiest] = true;
+
+            printf_P(PSTR("%3d %4u "), busiest, processes[busiest].niceness);
+            process_state_print(busiest);
+            printf_P(PSTR("\t%4lu %10lu %8lu %5u %8lu\n"), (unsigned long)(total >= 100 ? used[busiest] / (total / 100) : 0),
+                (unsigned long)stats[busiest].cycles, (unsigned long)stats[busiest].syscalls, stats[busiest].stack,
+                (unsigned long)stats[busiest].wall);
+        }
+        serial_println_P(PSTR("Press any key to stop"));
+    }
+}
+
+void checkpoint_command(uint8_t argc, char **argv) {
+    if (argc >= 3) {
+        if (!process_checkpoint(strtol(argv[1], NULL, 10), argv[2])) {
+            serial_println_P(PSTR("Process checkpoint error!"));
+        }
+    } else {
+        serial_println_P(PSTR("Help: checkpoint [pid] [file]"));
+    }
+}
+
+void resume_command(uint8_t argc, char **argv) {
+    if (argc >= 2) {
+        int8_t process = process_resume(argv[1]);
+        if (process != -1) {
+            if (argc >= 3 && !strcmp_P(argv[2], PSTR("&"))) {
+                return;
+            }
+            process_wait(process);
+        } else {
+            serial_println_P(PSTR("Process resume error!"));
+        }
+    } else {
+        serial_println_P(PSTR("Help: resume [file] &?"));
+    }
+}
+
+void trace_command(uint8_t argc, char **argv) {
+    if (argc >= 2) {
+        if (!strcmp_P(argv[1], PSTR("dump"))) {
+            uint16_t count = argc >= 3 ? (uint16_t)strtol(argv[2], NULL, 10) : processor_trace_size;
+            if (count > processor_trace_size) count = processor_trace_size;
+            for (uint16_t i = count; i > 0; i--) {
+                processor_trace_print(processor_trace_get(i - 1));
+            }
+        }
+
+        if (!strcmp_P(argv[1], PSTR("save")) && argc >= 3) {
+            #ifdef ARDUINO
+                int8_t file = file_open(argv[2], FILE_OPEN_MODE_WRITE);
+                if (file != -1) {
+                    for (uint16_t i = processor_trace_size; i > 0; i--) {
+                        if (file_write(file, (uint8_t *)processor_trace_get(i - 1), sizeof(ProcessorTrace)) == -1) {
+                            serial_println_P(file_write_error);
+                            break;
+                        }
+                    }
+                    file_close(file);
+                } else {
+                    serial_println_P(file_open_error);
+                }
+            #else
+                // The host trace ring is bigger than the disk so it is saved
+                // as a file on the host
+                FILE *out_file = fopen(argv[2], "wb");
+                if (out_file != NULL) {
+                    for (uint16_t i = processor_trace_size; i > 0; i--) {
+                        fwrite(processor_trace_get(i - 1), sizeof(ProcessorTrace), 1, out_file);
+                    }
+                    fclose(out_file);
+                } else {
+                    printf("File write error!\n");
+                }
+            #endif
+        }
+
+        if (!strcmp_P(argv[1], PSTR("clear"))) {
+            processor_trace_clear();
+        }
+    } else {
+        serial_println_P(PSTR("Help: trace dump [count]?, trace save [file], trace clear"));
+    }
+}
+
+#ifndef ARDUINO
+    // Finds the function symbol that contains pc in the avr-nm symbol map
+    // that goldos-build.sh writes next to the program
+    static bool profile_symbol(char *name, uint16_t pc, char *symbol, uint16_t *offset) {
+        char path[64];
+        uint8_t size = 0;
+        while (name[size] != '\0' && name[size] != '.' && size < sizeof(path) - sizeof(".sym")) {
+            path[size] = name[size];
+            size++;
+        }
+        strcpy(&path[size], ".sym");
+
+        FILE *symbols_file = fopen(path, "r");
+        if (symbols_file == NULL) {
+            return false;
+        }
+
+        bool found = false;
+        uint16_t best_address = 0;
+        char line[80];
+        while (fgets(line, sizeof(line), symbols_file) != NULL) {
+            unsigned long address;
+            char type;
+            char line_symbol[PROFILE_SYMBOL_SIZE];
+            if (
+                sscanf(line, "%lx %c %31s", &address, &type, line_symbol) == 3 &&
+                (type == 'T' || type == 't' || type == 'W' || type == 'A') &&
+                address <= pc && (!found || address >= best_address)
+            ) {
+                found = true;
+                best_address = address;
+                strcpy(symbol, line_symbol);
+            }
+        }
+        fclose(symbols_file);
+        *offset = pc - best_address;
+        return found;
+    }
+
+    static void profile_percent(uint32_t count, uint32_t total) {
+        printf_P(PSTR("%lu (%lu%%)"), (unsigned long)count, (unsigned long)(total != 0 ? count * 100 / total : 0));
+    }
+
+    void profile_command(uint8_t argc, char **argv) {
+        if (argc >= 2) {
+            int8_t process = process_open(argv[1], false, 0);
+            if (process != -1) {
+                process_profile(process, true);
+                process_wait(process);
+
+                printf_P(PSTR("Profile: %lu instructions\n"), (unsigned long)processor_profile.instructions);
+                serial_println_P(PSTR("Classes:"));
+                const char *class_names[PROCESSOR_CLASSES_SIZE] = { PSTR("arithmetic"), PSTR("branch"),
+                    PSTR("transfer"), PSTR("bit"), PSTR("syscall") };
+                for (uint8_t i = 0; i < PROCESSOR_CLASSES_SIZE; i++) {
+                    printf_P(PSTR("- %s: "), class_names[i]);
+                    profile_percent(processor_profile.classes[i], processor_profile.instructions);
+                    serial_write('\n');
+                }
+
+                // Print the hottest addresses by picking the highest count and
+                // clearing it until enough addresses are printed
+                serial_println_P(PSTR("Hot addresses:"));
+                uint8_t top = argc >= 3 ? strtol(argv[2], NULL, 10) : PROFILE_TOP_SIZE;
+                for (uint8_t i = 0; i < top; i++) {
+                    uint16_t hottest = 0;
+                    for (uint16_t j = 1; j < PROCESSOR_PROFILE_SIZE; j++) {
+                        if (processor_profile.counts[j] > processor_profile.counts[hottest]) hottest = j;
+                    }
+                    if (processor_profile.counts[hottest] == 0) break;
+
+                    uint16_t pc = hottest << 1;
+                    printf_P(PSTR("- 0x%04x"), pc);
+                    char symbol[PROFILE_SYMBOL_SIZE];
+                    uint16_t offset;
+                    if (profile_symbol(argv[1], pc, symbol, &offset)) {
+                        printf_P(PSTR(" %s+0x%x"), symbol, offset);
+                    }
+                    serial_print_P(PSTR(": "));
+                    profile_percent(processor_profile.counts[hottest], processor_profile.instructions);
+                    serial_write('\n');
+                    processor_profile.counts[hottest] = 0;
+                }
+            } else {
+                serial_println_P(process_open_error);
+            }
+        } else {
+            serial_println_P(PSTR("Help: profile [name] [count]?"));
+        }
+    }
+
+    // Runs the background processes on worker threads, zero workers runs
+    // them on the shell thread again
+    void workers_command(uint8_t argc, char **argv) {
+        if (argc >= 2) {
+            if (!processes_workers(strtol(argv[1], NULL, 10))) {
+                serial_println_P(PSTR("Workers error!"));
+            }
+        } else {
+            printf_P(PSTR("Workers: %u\n"), processes_workers_size);
+            serial_println_P(PSTR("Help: workers [count]"));
+        }
+    }
+#endif
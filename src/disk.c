@@ -1,95 +1,254 @@
 #include "disk.h"
-#include <stdbool.h>
 #include "eeprom.h"
+#include "cache.h"
 #include "utils.h"
 #include "serial.h"
+#include "processes.h"
+#include <string.h>
 
-uint16_t disk_alloc(uint16_t size) {
-    size = align(size > 0 ? size : 1, DISK_BLOCK_ALIGN);
-    uint16_t block_address = DISK_BLOCK_ALIGN;
+// The first format had no directory, every block started with boundary tags
+// and the files were found by walking them
+#define DISK_V1_START 8
+
+bool disk_ready = false;
+
+uint8_t disk_hash(char *name) {
+    uint8_t hash = 0;
+    while (*name != '\0') hash = ((hash << 3) | (hash >> 5)) + *name++;
+    return hash;
+}
+
+static bool disk_block_used(uint16_t block) {
+    return bit(cache_read_byte(DISK_BITMAP + block / 8), block % 8);
+}
+
+// Marks blocks in the bitmap, a byte of the bitmap is written once
+static void disk_blocks_mark(uint16_t block, uint16_t count, bool used) {
+    while (count != 0) {
+        uint16_t address = DISK_BITMAP + block / 8;
+        uint8_t byte = cache_read_byte(address);
+        do {
+            if (used) {
+                bit_set(byte, block % 8);
+            } else {
+                bit_clear(byte, block % 8);
+            }
+            block++;
+            count--;
+        } while (count != 0 && block % 8 != 0);
+        cache_write_byte(address, byte);
+    }
+}
+
+static uint16_t disk_blocks(uint16_t size) {
+    return size > 0 ? align(size, DISK_BLOCK_SIZE) / DISK_BLOCK_SIZE : 1;
+}
+
+// Writes the superblock and an empty directory and bitmap
+static void disk_layout(void) {
+    cache_write_byte(DISK_HEADER_SIGNATURE, 'G');
+    cache_write_byte(DISK_HEADER_SIGNATURE + 1, 'O');
+    cache_write_byte(DISK_HEADER_SIGNATURE + 2, 'L');
+    cache_write_byte(DISK_HEADER_SIGNATURE + 3, 'D');
+    cache_write_byte(DISK_HEADER_SIGNATURE + 4, 'F');
+    cache_write_byte(DISK_HEADER_SIGNATURE + 5, 'S');
+    cache_write_byte(DISK_HEADER_SIGNATURE + 6, '\0');
+    cache_write_byte(DISK_HEADER_VERSION, DISK_VERSION);
+    cache_write_byte(DISK_HEADER_BLOCK_SIZE, DISK_BLOCK_SIZE);
+    cache_write_byte(DISK_HEADER_DIRECTORY_SIZE, DISK_DIRECTORY_SIZE);
+    cache_write_word(DISK_HEADER_BLOCKS, DISK_BLOCKS);
+
+    for (uint16_t i = 0; i < DISK_DIRECTORY_SIZE; i++) {
+        cache_write_byte(DISK_ENTRY(i) + DISK_ENTRY_FLAGS, 0);
+    }
+    for (uint16_t i = 0; i < DISK_BITMAP_SIZE; i++) {
+        cache_write_byte(DISK_BITMAP + i, 0);
+    }
+    disk_ready = true;
+}
+
+typedef struct DiskUpgradeFile {
+    uint16_t address;
+    uint8_t name_size;
+    uint16_t size;
+} DiskUpgradeFile;
+
+// Moves the files of a v1 disk into the v2 layout in place. The files are
+// first packed at the end of the disk and then copied to their blocks from
+// the front, so no file is overwritten before it is moved. The disk is left
+// as it is when the files do not fit in the new layout
+static bool disk_upgrade(void) {
+    DiskUpgradeFile upgrade_files[DISK_DIRECTORY_SIZE];
+    uint8_t count = 0;
+    uint16_t total_size = 0;
+    uint16_t block_address = DISK_V1_START;
     while (block_address <= EEPROM_SIZE - 2 - 2) {
-        uint16_t block_header = eeprom_read_word(block_address);
+        uint16_t block_header = cache_read_word(block_address);
         uint16_t block_size = block_header & 0x7fff;
-        if ((block_header & 0x8000) == 0 && (block_size == size || block_size >= size + 2 + 2)) {
-            eeprom_write_word(block_address, 0x8000 | size);
-            eeprom_write_word(block_address + 2 + size, 0x8000 | size);
-            if (block_size != size) {
-                uint16_t new_next_block_address = block_address + 2 + size + 2;
-                uint16_t new_next_block_size = block_size - 2 - size - 2;
-                eeprom_write_word(new_next_block_address, new_next_block_size);
-                eeprom_write_word(new_next_block_address + 2 + new_next_block_size, new_next_block_size);
+        uint16_t real_block_address = block_address + 2;
+        if ((block_header & 0x8000) != 0) {
+            uint8_t file_name_size = cache_read_byte(real_block_address);
+            if (file_name_size != 0) {
+                if (count == DISK_DIRECTORY_SIZE) return false;
+                upgrade_files[count].address = real_block_address;
+                upgrade_files[count].name_size = file_name_size;
+                upgrade_files[count].size = cache_read_word(real_block_address + 1 + file_name_size);
+                total_size += 1 + file_name_size + 2 + upgrade_files[count].size;
+                count++;
             }
-            return block_address + 2;
         }
         block_address += 2 + block_size + 2;
     }
-    return 0;
-}
 
-void disk_free(uint16_t address) {
-    if (address == 0) return;
-    uint16_t block_address = address - 2;
-    uint16_t block_header = eeprom_read_word(block_address);
-    if ((block_header & 0x8000) == 0) return;
-    uint16_t block_size = block_header & 0x7fff;
-
-    if (block_address - 2 >= DISK_BLOCK_ALIGN + 2) {
-        uint16_t previous_block_header = eeprom_read_word(block_address - 2);
-        if ((previous_block_header & 0x8000) == 0) {
-            uint16_t previous_block_size = previous_block_header & 0x7fff;
-            block_address -= 2 + previous_block_size + 2;
-            block_size += 2 + previous_block_size + 2;
+    // A file may only move down when it is copied to its blocks
+    uint16_t source = EEPROM_SIZE - total_size;
+    uint16_t blocks = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (DISK_BLOCK_ADDRESS(blocks) > source) return false;
+        blocks += disk_blocks(1 + upgrade_files[i].name_size + upgrade_files[i].size);
+        source += 1 + upgrade_files[i].name_size + 2 + upgrade_files[i].size;
+    }
+    if (blocks > DISK_BLOCKS) return false;
+
+    uint16_t end = EEPROM_SIZE;
+    for (uint8_t i = count; i-- > 0;) {
+        uint16_t size = 1 + upgrade_files[i].name_size + 2 + upgrade_files[i].size;
+        end -= size;
+        for (uint16_t j = size; j-- > 0;) {
+            cache_write_byte(end + j, cache_read_byte(upgrade_files[i].address + j));
+        }
+        upgrade_files[i].address = end;
+    }
+
+    blocks = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        uint16_t address = DISK_BLOCK_ADDRESS(blocks);
+        uint8_t name_size = upgrade_files[i].name_size;
+        for (uint16_t j = 0; j < 1 + name_size; j++) {
+            cache_write_byte(address + j, cache_read_byte(upgrade_files[i].address + j));
+        }
+        for (uint16_t j = 0; j < upgrade_files[i].size; j++) {
+            cache_write_byte(address + 1 + name_size + j, cache_read_byte(upgrade_files[i].address + 1 + name_size + 2 + j));
         }
+        upgrade_files[i].address = address;
+        blocks += disk_blocks(1 + name_size + upgrade_files[i].size);
     }
 
-    if (block_address + 2 + block_size + 2 <= EEPROM_SIZE - 2 - 2) {
-        uint16_t next_block_header = eeprom_read_word(block_address + 2 + block_size + 2);
-        if ((next_block_header & 0x8000) == 0) {
-            uint16_t next_block_size = next_block_header & 0x7fff;
-            block_size += 2 + next_block_size + 2;
+    disk_layout();
+    for (uint8_t i = 0; i < count; i++) {
+        char file_name[64];
+        for (uint8_t j = 0; j < upgrade_files[i].name_size; j++) {
+            file_name[j] = cache_read_byte(upgrade_files[i].address + 1 + j);
         }
+        file_name[upgrade_files[i].name_size] = '\0';
+
+        uint16_t block = DISK_ADDRESS_BLOCK(upgrade_files[i].address);
+        uint16_t file_blocks = disk_blocks(1 + upgrade_files[i].name_size + upgrade_files[i].size);
+        cache_write_byte(DISK_ENTRY(i) + DISK_ENTRY_FLAGS, DISK_ENTRY_USED);
+        cache_write_byte(DISK_ENTRY(i) + DISK_ENTRY_HASH, disk_hash(file_name));
+        cache_write_word(DISK_ENTRY(i) + DISK_ENTRY_BLOCK, block);
+        cache_write_word(DISK_ENTRY(i) + DISK_ENTRY_FILE_SIZE, upgrade_files[i].size);
+        cache_write_word(DISK_ENTRY(i) + DISK_ENTRY_BLOCKS, file_blocks);
+        disk_blocks_mark(block, file_blocks, true);
+    }
+    return true;
+}
+
+void disk_begin(void) {
+    char signature[7];
+    for (uint8_t i = 0; i < 7; i++) {
+        signature[i] = cache_read_byte(DISK_HEADER_SIGNATURE + i);
+    }
+    if (strcmp_P(signature, PSTR("GOLDFS"))) {
+        serial_println_P(PSTR("Disk has no file system, formatting"));
+        disk_format();
+        return;
     }
 
-    eeprom_write_word(block_address, block_size);
-    eeprom_write_word(block_address + 2 + block_size, block_size);
+    uint8_t version = cache_read_byte(DISK_HEADER_VERSION);
+    if (version != DISK_VERSION) {
+        // The first format stored the version of the kernel here
+        serial_println_P(PSTR("Upgrading disk to GOLDFS v" STR(DISK_VERSION)));
+        if (!disk_upgrade()) serial_println_P(PSTR("Disk upgrade error!"));
+        cache_sync();
+        return;
+    }
+
+    disk_ready = cache_read_byte(DISK_HEADER_BLOCK_SIZE) == DISK_BLOCK_SIZE &&
+        cache_read_byte(DISK_HEADER_DIRECTORY_SIZE) == DISK_DIRECTORY_SIZE &&
+        cache_read_word(DISK_HEADER_BLOCKS) == DISK_BLOCKS;
+    if (!disk_ready) serial_println_P(PSTR("Disk layout error!"));
+}
+
+// Allocates the first run of free blocks that holds the size
+uint16_t disk_alloc(uint16_t size) {
+    if (!disk_ready) return 0;
+    uint16_t blocks = disk_blocks(size);
+    uint16_t run = 0;
+    for (uint16_t block = 0; block < DISK_BLOCKS; block++) {
+        run = disk_block_used(block) ? 0 : run + 1;
+        if (run == blocks) {
+            disk_blocks_mark(block + 1 - blocks, blocks, true);
+            return DISK_BLOCK_ADDRESS(block + 1 - blocks);
+        }
+    }
+    return 0;
+}
+
+// Grows an allocation in place when the blocks after it are free
+bool disk_grow(uint16_t address, uint16_t size, uint16_t new_size) {
+    if (!disk_ready || address == 0) return false;
+    uint16_t block = DISK_ADDRESS_BLOCK(address) + disk_blocks(size);
+    uint16_t end = DISK_ADDRESS_BLOCK(address) + disk_blocks(new_size);
+    if (end > DISK_BLOCKS) return false;
+    for (uint16_t i = block; i < end; i++) {
+        if (disk_block_used(i)) return false;
+    }
+    if (end > block) disk_blocks_mark(block, end - block, true);
+    return true;
+}
+
+void disk_free(uint16_t address, uint16_t size) {
+    if (!disk_ready || address < DISK_DATA) return;
+    uint16_t block = DISK_ADDRESS_BLOCK(address);
+    uint16_t blocks = disk_blocks(size);
+    if (block + blocks > DISK_BLOCKS) return;
+    disk_blocks_mark(block, blocks, false);
 }
 
 void disk_format(void) {
     #ifdef DEBUG
         for (uint16_t i = 0; i < EEPROM_SIZE; i++) {
-            eeprom_write_word(i, 0);
+            cache_write_word(i, 0);
         }
     #endif
 
-    eeprom_write_byte(DISK_HEADER_SIGNATURE, 'G');
-    eeprom_write_byte(DISK_HEADER_SIGNATURE + 1, 'O');
-    eeprom_write_byte(DISK_HEADER_SIGNATURE + 2, 'L');
-    eeprom_write_byte(DISK_HEADER_SIGNATURE + 3, 'D');
-    eeprom_write_byte(DISK_HEADER_SIGNATURE + 4, 'F');
-    eeprom_write_byte(DISK_HEADER_SIGNATURE + 5, 'S');
-    eeprom_write_byte(DISK_HEADER_SIGNATURE + 6, '\0');
-    eeprom_write_byte(DISK_HEADER_VERSION, (VERSION_MAJOR << 4) | VERSION_MINOR);
-
-    uint16_t free_block_size = EEPROM_SIZE - DISK_HEADER_SIZE - 2 - 2;
-    eeprom_write_word(DISK_HEADER_SIZE, free_block_size);
-    eeprom_write_word(EEPROM_SIZE - 2, free_block_size);
+    disk_layout();
+    cache_sync();
 }
 
 void disk_inspect(void) {
     serial_println_P(PSTR("Disk blocks:"));
 
-    uint16_t block_address = DISK_BLOCK_ALIGN;
+    uint16_t files_count = 0;
+    for (uint16_t i = 0; i < DISK_DIRECTORY_SIZE; i++) {
+        if ((cache_read_byte(DISK_ENTRY(i) + DISK_ENTRY_FLAGS) & DISK_ENTRY_USED) != 0) files_count++;
+    }
+
     uint16_t free_block_count = 0;
     uint16_t free_blocks_size = 0;
     uint16_t max_free_block_size = 0;
-    while (block_address <= EEPROM_SIZE - 2 - 2) {
-        uint16_t block_header = eeprom_read_word(block_address);
-        uint16_t block_size = block_header & 0x7fff;
+    uint16_t block = 0;
+    while (block < DISK_BLOCKS) {
+        bool used = disk_block_used(block);
+        uint16_t run = 0;
+        while (block + run < DISK_BLOCKS && disk_block_used(block + run) == used) run++;
+        uint16_t block_size = run * DISK_BLOCK_SIZE;
 
         serial_print_P(PSTR("- "));
-        serial_print_word(block_address + 2, '0');
+        serial_print_word(DISK_BLOCK_ADDRESS(block), '0');
 
-        if ((block_header & 0x8000) == 0) {
+        if (!used) {
             serial_print_P(PSTR(": Free block of "));
             serial_print_number(block_size, '\0');
             serial_println_P(PSTR(" bytes"));
@@ -105,7 +264,8 @@ void disk_inspect(void) {
             serial_println_P(PSTR(" bytes"));
         }
 
-        block_address += 2 + block_size + 2;
+        block += run;
+        processes_yield();
     }
 
     serial_print_P(PSTR("\nFree blocks size is "));
@@ -114,5 +274,9 @@ void disk_inspect(void) {
     serial_print_number(free_block_count, '\0');
     serial_print_P(PSTR(" free blocks\nLargest free block is "));
     serial_print_number(max_free_block_size, '\0');
-    serial_println_P(PSTR(" bytes"));
+    serial_print_P(PSTR(" bytes\nDirectory has "));
+    serial_print_number(files_count, '\0');
+    serial_print_P(PSTR(" of "));
+    serial_print_number(DISK_DIRECTORY_SIZE, '\0');
+    serial_println_P(PSTR(" files"));
 }
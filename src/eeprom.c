@@ -6,8 +6,54 @@
     #include <stdio.h>
 #endif
 #include "serial.h"
+#include "processes.h"
 
-#ifndef ARDUINO
+#ifdef ARDUINO
+    typedef struct EepromWrite {
+        uint16_t address;
+        uint8_t byte;
+    } EepromWrite;
+
+    volatile EepromWrite eeprom_queue[EEPROM_QUEUE_SIZE];
+    volatile uint8_t eeprom_queue_position = 0;
+    volatile uint8_t eeprom_queue_size = 0;
+
+    // Programs the next byte of the queue, the interrupt fires while the
+    // EEPROM is ready and is turned off when the queue is empty
+    ISR(EE_READY_vect) {
+        if (eeprom_queue_size == 0) {
+            EECR &= ~_BV(EERIE);
+            processes_event(PROCESSOR_EVENT_EEPROM);
+            return;
+        }
+
+        volatile EepromWrite *write = &eeprom_queue[eeprom_queue_position];
+        EEAR = write->address;
+        EEDR = write->byte;
+        EECR |= _BV(EEMPE);
+        EECR |= _BV(EEPE);
+        eeprom_queue_position = (eeprom_queue_position + 1) % EEPROM_QUEUE_SIZE;
+        eeprom_queue_size--;
+    }
+
+    // Reads a byte from the EEPROM itself after the last write is done
+    static uint8_t eeprom_read(uint16_t address) {
+        loop_until_bit_is_clear(EECR, EEPE);
+        EEAR = address;
+        EECR |= _BV(EERE);
+        return EEDR;
+    }
+
+    // Returns the queued write of an address or NULL, the interrupt must be
+    // off so the queue does not change
+    static volatile EepromWrite *eeprom_queue_find(uint16_t address) {
+        for (uint8_t i = 0; i < eeprom_queue_size; i++) {
+            volatile EepromWrite *write = &eeprom_queue[(eeprom_queue_position + i) % EEPROM_QUEUE_SIZE];
+            if (write->address == address) return write;
+        }
+        return NULL;
+    }
+#else
     uint8_t eeprom_data[EEPROM_SIZE] = {0};
 
     void eeprom_begin(void) {
@@ -25,27 +71,43 @@
     }
 #endif
 
+// A byte that waits in the queue is newer than the one in the EEPROM. With
+// an empty queue the interrupt does not touch the EEPROM registers, so the
+// byte is read without turning it off
 uint8_t eeprom_read_byte(uint16_t address) {
     #ifdef ARDUINO
-        loop_until_bit_is_clear(EECR, EEPE);
-        EEAR = address;
-        EECR |= _BV(EERE);
-        return EEDR;
+        if (eeprom_queue_size == 0) return eeprom_read(address);
+
+        uint8_t byte;
+        EECR &= ~_BV(EERIE);
+        volatile EepromWrite *write = eeprom_queue_find(address);
+        if (write != NULL) {
+            byte = write->byte;
+        } else {
+            byte = eeprom_read(address);
+        }
+        if (eeprom_queue_size != 0) EECR |= _BV(EERIE);
+        return byte;
     #else
         return eeprom_data[address];
     #endif
 }
 
+// Queues a write and returns, a queued write of the same address is changed
+// in place. It only waits when the queue is full
 void eeprom_write_byte(uint16_t address, uint8_t byte) {
     if (eeprom_read_byte(address) != byte) {
         #ifdef ARDUINO
-            loop_until_bit_is_clear(EECR, EEPE);
-            EEAR = address;
-            EEDR = byte;
-            cli();
-            EECR |= _BV(EEMPE);
-            EECR |= _BV(EEPE);
-            sei();
+            while (eeprom_queue_size == EEPROM_QUEUE_SIZE);
+            EECR &= ~_BV(EERIE);
+            volatile EepromWrite *write = eeprom_queue_find(address);
+            if (write == NULL) {
+                write = &eeprom_queue[(eeprom_queue_position + eeprom_queue_size) % EEPROM_QUEUE_SIZE];
+                write->address = address;
+                eeprom_queue_size++;
+            }
+            write->byte = byte;
+            EECR |= _BV(EERIE);
         #else
             eeprom_data[address] = byte;
         #endif
@@ -61,6 +123,32 @@ void eeprom_write_word(uint16_t address, uint16_t word) {
     eeprom_write_byte(address + 1, word >> 8);
 }
 
+// Returns the number of bytes that wait to be programmed
+uint8_t eeprom_pending(void) {
+    #ifdef ARDUINO
+        return eeprom_queue_size;
+    #else
+        return 0;
+    #endif
+}
+
+// Returns the number of bytes that can be queued without waiting
+uint8_t eeprom_available(void) {
+    #ifdef ARDUINO
+        return EEPROM_QUEUE_SIZE - eeprom_queue_size;
+    #else
+        return UINT8_MAX;
+    #endif
+}
+
+// Waits until the queued bytes are in the EEPROM
+void eeprom_sync(void) {
+    #ifdef ARDUINO
+        while (eeprom_queue_size != 0);
+        loop_until_bit_is_clear(EECR, EEPE);
+    #endif
+}
+
 void eeprom_dump(void) {
     serial_print_P(PSTR("     "));
     for (uint8_t x = 0; x < 16; x++) {
@@ -89,5 +177,6 @@ void eeprom_dump(void) {
             serial_write(character);
             serial_write(x == 15 ? '\n' : ' ');
         }
+        processes_yield();
     }
 }
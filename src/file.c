@@ -1,86 +1,277 @@
 #include "file.h"
 #include "disk.h"
-#include "eeprom.h"
+#include "cache.h"
+#include "processes.h"
+#include "utils.h"
 #include <stdlib.h>
 #include <string.h>
 
 File files[FILE_SIZE];
 
+FileEntry files_index[FILE_INDEX_SIZE];
+
+// Compares a name with the name of a file block without copying it
+static bool file_name_equals(uint16_t address, char *name) {
+    uint8_t name_size = cache_read_byte(address);
+    for (uint8_t i = 0; i < name_size; i++) {
+        if (name[i] != (char)cache_read_byte(address + 1 + i)) return false;
+    }
+    return name[name_size] == '\0';
+}
+
+// The index is a copy of the directory in RAM, so a file is found without
+// reading the names of the other files from the disk
+void file_begin(void) {
+    for (uint8_t i = 0; i < FILE_INDEX_SIZE; i++) {
+        files_index[i].address = 0;
+        if (disk_ready && (cache_read_byte(DISK_ENTRY(i) + DISK_ENTRY_FLAGS) & DISK_ENTRY_USED) != 0) {
+            files_index[i].address = DISK_BLOCK_ADDRESS(cache_read_word(DISK_ENTRY(i) + DISK_ENTRY_BLOCK));
+            files_index[i].size = cache_read_word(DISK_ENTRY(i) + DISK_ENTRY_FILE_SIZE);
+            files_index[i].hash = cache_read_byte(DISK_ENTRY(i) + DISK_ENTRY_HASH);
+        }
+    }
+}
+
+// Returns the directory entry of a file, -1 when it does not exist
+static int8_t file_find(char *name) {
+    uint8_t hash = disk_hash(name);
+    for (uint8_t i = 0; i < FILE_INDEX_SIZE; i++) {
+        if (files_index[i].address != 0 && files_index[i].hash == hash && file_name_equals(files_index[i].address, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void file_entry_size(uint8_t entry, uint16_t size) {
+    files_index[entry].size = size;
+    cache_write_word(DISK_ENTRY(entry) + DISK_ENTRY_FILE_SIZE, size);
+}
+
+static void file_entry_address(uint8_t entry, uint16_t address, uint16_t blocks) {
+    files_index[entry].address = address;
+    cache_write_word(DISK_ENTRY(entry) + DISK_ENTRY_BLOCK, DISK_ADDRESS_BLOCK(address));
+    cache_write_word(DISK_ENTRY(entry) + DISK_ENTRY_BLOCKS, blocks);
+}
+
+// Moves the position of an open file to the start of its first extent
+static void file_extent_first(File *file) {
+    file->extent = file->address;
+    file->extent_start = 0;
+    file->extent_link = 0;
+}
+
+static uint16_t file_extent_blocks(File *file) {
+    if (file->extent_link == 0) return cache_read_word(DISK_ENTRY(file->entry) + DISK_ENTRY_BLOCKS);
+    return cache_read_word(file->extent_link + 2);
+}
+
+static uint16_t file_extent_header(File *file) {
+    return file->extent_link == 0 ? 1 + file->name_size : 0;
+}
+
+// Returns the bytes of data the extent can hold when it is the last one, an
+// extent that is smaller than its header holds none
+static uint16_t file_extent_capacity(File *file) {
+    uint16_t size = file_extent_blocks(file) * DISK_BLOCK_SIZE;
+    uint16_t header = file_extent_header(file);
+    return size > header ? size - header : 0;
+}
+
+// Moves to the next extent, returns false when it is the last one, an extent
+// without room for the link is always the last one
+static bool file_extent_next(File *file) {
+    uint16_t capacity = file_extent_capacity(file);
+    if (capacity <= DISK_LINK_SIZE || file->size - file->extent_start <= capacity) return false;
+    file->extent_link = file->extent + file_extent_blocks(file) * DISK_BLOCK_SIZE - DISK_LINK_SIZE;
+    file->extent_start += capacity - DISK_LINK_SIZE;
+    file->extent = DISK_BLOCK_ADDRESS(cache_read_word(file->extent_link));
+    return true;
+}
+
+// Walks the extents to the one that holds a position, from the extent of the
+// last position or from the first one when the position is before it
+static void file_extent_seek(File *file, uint16_t position) {
+    if (position < file->extent_start) file_extent_first(file);
+    while (position - file->extent_start + DISK_LINK_SIZE >= file_extent_capacity(file) && file_extent_next(file));
+}
+
+// Returns the address of the position of an open file and the number of
+// bytes after it in the same extent
+static uint16_t file_extent_address(File *file, uint16_t *count) {
+    file_extent_seek(file, file->position);
+    uint16_t capacity = file_extent_capacity(file);
+    if (file->size - file->extent_start > capacity) capacity -= DISK_LINK_SIZE;
+    uint16_t offset = file->position - file->extent_start;
+    *count = capacity - offset;
+    return file->extent + file_extent_header(file) + offset;
+}
+
+// Points the directory entry or the link of the extent at its blocks
+static void file_extent_set(File *file, uint16_t address, uint16_t size) {
+    uint16_t blocks = align(size, DISK_BLOCK_SIZE) / DISK_BLOCK_SIZE;
+    if (file->extent_link == 0) {
+        if (address != file->address) processes_invalidate(file->address);
+        file->address = address;
+        file_entry_address(file->entry, address, blocks);
+    } else {
+        cache_write_word(file->extent_link, DISK_ADDRESS_BLOCK(address));
+        cache_write_word(file->extent_link + 2, blocks);
+    }
+    file->extent = address;
+}
+
+// Makes room for a new size, the last extent takes the free blocks after it
+// or a new extent is linked to it, so the data of the file stays in place
+static bool file_extend(File *file, uint16_t new_size) {
+    file_extent_seek(file, file->size);
+    uint16_t blocks = file_extent_blocks(file);
+    uint16_t header = file_extent_header(file);
+    uint16_t capacity = file_extent_capacity(file);
+    uint16_t used = file->size - file->extent_start;
+    uint16_t needed = new_size - file->extent_start;
+    if (needed <= capacity) return true;
+
+    if (disk_grow(file->extent, blocks * DISK_BLOCK_SIZE, header + needed)) {
+        file_extent_set(file, file->extent, header + needed);
+        return true;
+    }
+
+    // An extent without room for the link moves to a larger run of blocks
+    if (capacity <= DISK_LINK_SIZE) {
+        uint16_t address = disk_alloc(header + needed);
+        if (address == 0) return false;
+        for (uint16_t i = 0; i < header + used; i++) {
+            cache_write_byte(address + i, cache_read_byte(file->extent + i));
+        }
+        disk_free(file->extent, blocks * DISK_BLOCK_SIZE);
+        file_extent_set(file, address, header + needed);
+        return true;
+    }
+
+    // The bytes under the link go to the new extent
+    uint16_t kept = capacity - DISK_LINK_SIZE;
+    uint16_t address = disk_alloc(needed - kept);
+    if (address == 0) return false;
+    for (uint16_t i = kept; i < used; i++) {
+        cache_write_byte(address + i - kept, cache_read_byte(file->extent + header + i));
+    }
+    uint16_t link = file->extent + blocks * DISK_BLOCK_SIZE - DISK_LINK_SIZE;
+    cache_write_word(link, DISK_ADDRESS_BLOCK(address));
+    cache_write_word(link + 2, align(needed - kept, DISK_BLOCK_SIZE) / DISK_BLOCK_SIZE);
+    return true;
+}
+
+// Frees the extents of a file, the first one is kept when it is truncated
+static void file_extents_free(File *file, bool first) {
+    file_extent_first(file);
+    bool more;
+    do {
+        uint16_t address = file->extent;
+        uint16_t size = file_extent_blocks(file) * DISK_BLOCK_SIZE;
+        bool free = first || file->extent_link != 0;
+        more = file_extent_next(file);
+        if (free) disk_free(address, size);
+    } while (more);
+    file_extent_first(file);
+}
+
+// Copies the data of a file to one run of blocks after room for a name
+static uint16_t file_extents_copy(File *file, uint8_t name_size) {
+    uint16_t address = disk_alloc(1 + name_size + file->size);
+    if (address == 0) return 0;
+    file->position = 0;
+    while (file->position < file->size) {
+        uint16_t count;
+        uint16_t extent_address = file_extent_address(file, &count);
+        while (count-- > 0 && file->position < file->size) {
+            cache_write_byte(address + 1 + name_size + file->position++, cache_read_byte(extent_address++));
+        }
+    }
+    return address;
+}
+
+// Opens the file of a directory entry to walk its extents
+static void file_entry_open(File *file, uint8_t entry) {
+    file->address = files_index[entry].address;
+    file->name_size = cache_read_byte(file->address);
+    file->size = files_index[entry].size;
+    file->position = 0;
+    file->entry = entry;
+    file_extent_first(file);
+}
+
 int8_t file_open(char *name, uint8_t mode) {
-    uint16_t block_address = DISK_BLOCK_ALIGN;
-    while (block_address <= EEPROM_SIZE - 2 - 2) {
-        uint16_t real_block_address = block_address + 2;
-        uint16_t block_header = eeprom_read_word(block_address);
-        uint16_t block_size = block_header & 0x7fff;
-        if ((block_header & 0x8000) != 0) {
-            uint8_t file_name_size = eeprom_read_byte(real_block_address);
-            if (file_name_size != 0) {
-                char file_name[64];
-                for (uint8_t i = 0; i < file_name_size; i++) {
-                    file_name[i] = eeprom_read_byte(real_block_address + 1 + i);
+    int8_t entry = file_find(name);
+    if (entry != -1) {
+        for (int8_t i = 0; i < FILE_SIZE; i++) {
+            if (files[i].address == 0) {
+                file_entry_open(&files[i], entry);
+                files[i].mode = mode;
+
+                if (mode == FILE_OPEN_MODE_WRITE) {
+                    processes_invalidate(files[i].address);
+                    file_extents_free(&files[i], false);
+                    files[i].size = 0;
+                    file_entry_size(entry, files[i].size);
                 }
-                file_name[file_name_size] = '\0';
-
-                if (!strcmp(file_name, name)) {
-                    for (int8_t i = 0; i < FILE_SIZE; i++) {
-                        if (files[i].address == 0) {
-                            files[i].address = real_block_address;
-                            files[i].name_size = file_name_size;
-
-                            if (mode == FILE_OPEN_MODE_READ) {
-                                files[i].size = eeprom_read_word(real_block_address + 1 + file_name_size);
-                                files[i].position = 0;
-                            }
-
-                            if (mode == FILE_OPEN_MODE_WRITE) {
-                                files[i].size = 0;
-                                files[i].position = 0;
-                                eeprom_write_word(real_block_address + 1 + file_name_size, files[i].size);
-                            }
-
-                            if (mode == FILE_OPEN_MODE_APPEND) {
-                                files[i].size = eeprom_read_word(real_block_address + 1 + file_name_size);
-                                files[i].position = files[i].size;
-                            }
-
-                            return i;
-                        }
-                    }
-                    return - 1;
+
+                if (mode == FILE_OPEN_MODE_APPEND) {
+                    files[i].position = files[i].size;
                 }
+
+                return i;
             }
         }
-        block_address += 2 + block_size + 2;
+        return - 1;
     }
 
     if (mode == FILE_OPEN_MODE_WRITE || mode == FILE_OPEN_MODE_APPEND) {
-        for (int8_t i = 0; i < FILE_SIZE; i++) {
-            if (files[i].address == 0) {
-                files[i].name_size = strlen(name);
-                files[i].address = disk_alloc(1 + files[i].name_size + 2);
-                files[i].size = 0;
-                files[i].position = 0;
-
-                eeprom_write_byte(files[i].address, files[i].name_size);
-                for (uint8_t j = 0; j < files[i].name_size; j++) {
-                    eeprom_write_byte(files[i].address + 1 + j, name[j]);
-                }
-                eeprom_write_word(files[i].address + 1 + files[i].name_size, files[i].size);
+        for (uint8_t j = 0; j < FILE_INDEX_SIZE; j++) {
+            if (files_index[j].address == 0) {
+                for (int8_t i = 0; i < FILE_SIZE; i++) {
+                    if (files[i].address == 0) {
+                        files[i].name_size = strlen(name);
+                        files[i].address = disk_alloc(1 + files[i].name_size);
+                        if (files[i].address == 0) return -1;
+                        files[i].entry = j;
+                        files[i].size = 0;
+                        files[i].position = 0;
+                        files[i].mode = mode;
+                        file_extent_first(&files[i]);
 
-                return i;
+                        cache_write_byte(files[i].address, files[i].name_size);
+                        for (uint8_t k = 0; k < files[i].name_size; k++) {
+                            cache_write_byte(files[i].address + 1 + k, name[k]);
+                        }
+
+                        files_index[j].hash = disk_hash(name);
+                        cache_write_byte(DISK_ENTRY(j) + DISK_ENTRY_HASH, files_index[j].hash);
+                        file_entry_size(j, files[i].size);
+                        file_entry_address(j, files[i].address, align(1 + files[i].name_size, DISK_BLOCK_SIZE) / DISK_BLOCK_SIZE);
+                        cache_write_byte(DISK_ENTRY(j) + DISK_ENTRY_FLAGS, DISK_ENTRY_USED);
+                        return i;
+                    }
+                }
+                return -1;
             }
         }
     }
     return -1;
 }
 
-bool file_name(int8_t file, char *buffer) {
+// Copies the name of a file to a buffer of size bytes, a name that does not
+// fit is cut and false is returned like for a file that is not open
+bool file_name(int8_t file, char *buffer, uint16_t size) {
+    if (size == 0) return false;
+    buffer[0] = '\0';
     if (file >= 0 && file < FILE_SIZE && files[file].address != 0) {
-        for (uint8_t i = 0; i < files[file].name_size; i++) {
-            buffer[i] = eeprom_read_byte(files[file].address + 1 + i);
+        uint8_t name_size = files[file].name_size < size ? files[file].name_size : size - 1;
+        for (uint8_t i = 0; i < name_size; i++) {
+            buffer[i] = cache_read_byte(files[file].address + 1 + i);
         }
-        buffer[files[file].name_size] = '\0';
-        return true;
+        buffer[name_size] = '\0';
+        return files[file].name_size < size;
     }
     return false;
 }
@@ -102,16 +293,45 @@ int16_t file_position(int8_t file) {
 bool file_seek(int8_t file, int16_t position) {
     if (file >= 0 && file < FILE_SIZE && files[file].address != 0) {
         files[file].position = position;
+        if (position >= 0 && position < files[file].size) file_extent_seek(&files[file], position);
         return true;
     }
     return false;
 }
 
+// Returns the address of the data of an open file in the EEPROM, a file of
+// more extents is first moved to one run of blocks so a program can run from it
+uint16_t file_data(int8_t file) {
+    if (file >= 0 && file < FILE_SIZE && files[file].address != 0) {
+        File *f = &files[file];
+        file_extent_first(f);
+        if (file_extent_next(f)) {
+            uint16_t position = f->position;
+            uint16_t address = file_extents_copy(f, f->name_size);
+            f->position = position;
+            if (address == 0) return 0;
+            for (uint8_t i = 0; i < 1 + f->name_size; i++) {
+                cache_write_byte(address + i, cache_read_byte(f->address + i));
+            }
+            file_extents_free(f, true);
+            file_extent_set(f, address, 1 + f->name_size + f->size);
+        }
+        return f->address + 1 + f->name_size;
+    }
+    return 0;
+}
+
 int16_t file_read(int8_t file, uint8_t *buffer, int16_t size) {
     if (file >= 0 && file < FILE_SIZE && files[file].address != 0) {
+        File *f = &files[file];
         int16_t bytes_read = 0;
-        while (bytes_read < size && files[file].position < files[file].size) {
-            buffer[bytes_read++] = eeprom_read_byte(files[file].address + 1 + files[file].name_size + 2 + files[file].position++);
+        while (bytes_read < size && f->position < f->size) {
+            uint16_t count;
+            uint16_t address = file_extent_address(f, &count);
+            while (count-- > 0 && bytes_read < size && f->position < f->size) {
+                buffer[bytes_read++] = cache_read_byte(address++);
+                f->position++;
+            }
         }
         return bytes_read;
     }
@@ -122,30 +342,21 @@ int16_t file_write(int8_t file, uint8_t *buffer, int16_t size) {
     if (file >= 0 && file < FILE_SIZE && files[file].address != 0) {
         if (size == -1) size = strlen((char *)buffer);
 
-        uint16_t new_size = files[file].size + size;
-        uint16_t block_size = eeprom_read_word(files[file].address - 2) & 0x7fff;
-        if (new_size > block_size - 1 - files[file].name_size - 2) {
-            uint16_t new_block_address = disk_alloc(1 + files[file].name_size + 2 + new_size);
-            if (new_block_address != 0) {
-                for (uint16_t i = 0; i < block_size; i++) {
-                    uint8_t byte = eeprom_read_byte(files[file].address + i);
-                    eeprom_write_byte(new_block_address + i, byte);
-                }
-
-                disk_free(files[file].address);
-                files[file].address = new_block_address;
-            } else {
-                return -1;
-            }
-        }
-
-        files[file].size = new_size;
-        eeprom_write_word(files[file].address + 1 + files[file].name_size, files[file].size);
+        File *f = &files[file];
+        if (!file_extend(f, f->size + size)) return -1;
+        f->size += size;
+        file_entry_size(f->entry, f->size);
 
         int16_t bytes_writen = 0;
-        while (bytes_writen < size) {
-            eeprom_write_byte(files[file].address + 1 + files[file].name_size + 2 + files[file].position++, buffer[bytes_writen++]);
+        while (bytes_writen < size && f->position < f->size) {
+            uint16_t count;
+            uint16_t address = file_extent_address(f, &count);
+            while (count-- > 0 && bytes_writen < size) {
+                cache_write_byte(address++, buffer[bytes_writen++]);
+                f->position++;
+            }
         }
+        processes_invalidate(f->address);
         return bytes_writen;
     }
     return -1;
@@ -154,102 +365,77 @@ int16_t file_write(int8_t file, uint8_t *buffer, int16_t size) {
 bool file_close(int8_t file) {
     if (file >= 0 && file < FILE_SIZE && files[file].address != 0) {
         files[file].address = 0;
+        cache_sync();
         return true;
     }
     return false;
 }
 
 bool file_rename(char *old_name, char *new_name) {
-    uint16_t block_address = DISK_BLOCK_ALIGN;
-    while (block_address <= EEPROM_SIZE - 2 - 2) {
-        uint16_t block_header = eeprom_read_word(block_address);
-        uint16_t block_size = block_header & 0x7fff;
-        if ((block_header & 0x8000) != 0) {
-            uint16_t old_block_address = block_address + 2;
-            uint8_t file_name_size = eeprom_read_byte(old_block_address);
-            if (file_name_size != 0) {
-                char file_name[64];
-                for (uint8_t i = 0; i < file_name_size; i++) {
-                    file_name[i] = eeprom_read_byte(old_block_address + 1 + i);
-                }
-                file_name[file_name_size] = '\0';
+    // The names stay unique so a name has one entry in the directory
+    if (file_find(new_name) != -1) return false;
 
-                uint16_t file_size = eeprom_read_word(old_block_address + 1 + file_name_size);
-                if (!strcmp(file_name, old_name)) {
-                    uint8_t new_file_name_size = strlen(new_name);
+    int8_t entry = file_find(old_name);
+    if (entry != -1) {
+        File file;
+        file_entry_open(&file, entry);
+        uint8_t new_file_name_size = strlen(new_name);
 
-                    uint16_t new_block_address = disk_alloc(1 + new_file_name_size + 2 + file_size);
-                    if (new_block_address != 0) {
-                        for (uint16_t i = 0; i < file_size; i++) {
-                            uint8_t byte = eeprom_read_byte(old_block_address + 1 + file_name_size + 2 + i);
-                            eeprom_write_byte(new_block_address + 1 + new_file_name_size + 2 + i, byte);
-                        }
+        // A name of the same length is written over the old one, else the
+        // file moves to one run of blocks
+        uint16_t new_block_address = file.address;
+        if (new_file_name_size != file.name_size) {
+            new_block_address = file_extents_copy(&file, new_file_name_size);
+            if (new_block_address == 0) return false;
+        }
 
-                        eeprom_write_byte(new_block_address, new_file_name_size);
-                        for (uint8_t i = 0; i < new_file_name_size; i++) {
-                            eeprom_write_byte(new_block_address + 1 + i, new_name[i]);
-                        }
-                        eeprom_write_word(new_block_address + 1 + new_file_name_size, file_size);
+        cache_write_byte(new_block_address, new_file_name_size);
+        for (uint8_t i = 0; i < new_file_name_size; i++) {
+            cache_write_byte(new_block_address + 1 + i, new_name[i]);
+        }
+        files_index[entry].hash = disk_hash(new_name);
+        cache_write_byte(DISK_ENTRY(entry) + DISK_ENTRY_HASH, files_index[entry].hash);
 
-                        disk_free(old_block_address);
-                        return true;
-                    } else {
-                        return false;
-                    }
-                }
-            }
+        processes_invalidate(file.address);
+        if (new_block_address != file.address) {
+            file_extents_free(&file, true);
+            file_entry_address(entry, new_block_address, align(1 + new_file_name_size + file.size, DISK_BLOCK_SIZE) / DISK_BLOCK_SIZE);
         }
-        block_address += 2 + block_size + 2;
+        cache_sync();
+        return true;
     }
     return false;
 }
 
 bool file_delete(char *name) {
-    uint16_t block_address = DISK_BLOCK_ALIGN;
-    while (block_address <= EEPROM_SIZE - 2 - 2) {
-        uint16_t block_header = eeprom_read_word(block_address);
-        uint16_t real_block_address = block_address + 2;
-        uint16_t block_size = block_header & 0x7fff;
-        if ((block_header & 0x8000) != 0) {
-            uint8_t file_name_size = eeprom_read_byte(real_block_address);
-            if (file_name_size != 0) {
-                char file_name[64];
-                for (uint8_t i = 0; i < file_name_size; i++) {
-                    file_name[i] = eeprom_read_byte(real_block_address + 1 + i);
-                }
-                file_name[file_name_size] = '\0';
-
-                if (!strcmp(file_name, name)) {
-                    disk_free(real_block_address);
-                    return true;
-                }
-            }
-        }
-        block_address += 2 + block_size + 2;
+    int8_t entry = file_find(name);
+    if (entry != -1) {
+        File file;
+        file_entry_open(&file, entry);
+        processes_invalidate(file.address);
+        file_extents_free(&file, true);
+        cache_write_byte(DISK_ENTRY(entry) + DISK_ENTRY_FLAGS, 0);
+        files_index[entry].address = 0;
+        cache_sync();
+        return true;
     }
     return false;
 }
 
 bool file_list(char *name, uint16_t *size) {
-    static uint16_t block_address = DISK_BLOCK_ALIGN;
-    while (block_address <= EEPROM_SIZE - 2 - 2) {
-        uint16_t block_header = eeprom_read_word(block_address);
-        uint16_t real_block_address = block_address + 2;
-        uint16_t block_size = block_header & 0x7fff;
-        if ((block_header & 0x8000) != 0) {
-            uint8_t file_name_size = eeprom_read_byte(real_block_address);
-            if (file_name_size != 0) {
-                for (uint8_t i = 0; i < file_name_size; i++) {
-                    name[i] = eeprom_read_byte(real_block_address + 1 + i);
-                }
-                name[file_name_size] = '\0';
-                *size = eeprom_read_word(real_block_address + 1 + file_name_size);
-                block_address += 2 + block_size + 2;
-                return true;
+    static uint8_t position = 0;
+    while (position < FILE_INDEX_SIZE) {
+        FileEntry *entry = &files_index[position++];
+        if (entry->address != 0) {
+            uint8_t file_name_size = cache_read_byte(entry->address);
+            for (uint8_t i = 0; i < file_name_size; i++) {
+                name[i] = cache_read_byte(entry->address + 1 + i);
             }
+            name[file_name_size] = '\0';
+            *size = entry->size;
+            return true;
         }
-        block_address += 2 + block_size + 2;
     }
-    block_address = DISK_BLOCK_ALIGN;
+    position = 0;
     return false;
 }
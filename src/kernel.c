@@ -5,6 +5,10 @@
 #include "eeprom.h"
 #include "commands.h"
 #include "heap.h"
+#include "disk.h"
+#include "file.h"
+#include "processor.h"
+#include "processes.h"
 
 #define INPUT_BUFFER_SIZE 48
 
@@ -12,10 +16,13 @@ char input_buffer[INPUT_BUFFER_SIZE];
 
 uint8_t input_buffer_size;
 
-#define ARGUMENTS_MAX 8
+#define ARGUMENTS_MAX 12
 
 const PROGMEM char prompt[] = "> ";
 
+// A | splits words so a pipeline can be typed without spaces
+char pipe_argument[] = "|";
+
 void arguments_parse(char *buffer, char **arguments, uint8_t *size, uint8_t max_size) {
     *size = 0;
 
@@ -49,12 +56,21 @@ void arguments_parse(char *buffer, char **arguments, uint8_t *size, uint8_t max_
             pointer++;
         }
 
+        else if (*pointer == '|') {
+            arguments[(*size)++] = pipe_argument;
+            pointer++;
+        }
+
         else {
             arguments[(*size)++] = pointer;
-            while (*pointer != ' ') {
+            while (*pointer != ' ' && *pointer != '|') {
                 if (*pointer == '\0') return;
                 pointer++;
             }
+            if (*pointer == '|') {
+                if (*size == max_size) return;
+                arguments[(*size)++] = pipe_argument;
+            }
             *pointer = '\0';
             pointer++;
         }
@@ -70,8 +86,16 @@ int main(void) {
 
     heap_begin();
 
+    processor_begin();
+
+    processes_begin();
+
     serial_println_P(PSTR("\x1b[2J\x1b[;H\x1b[32mGoldOS v" STR(VERSION_MAJOR) "." STR(VERSION_MINOR) "\x1b[0m"));
 
+    disk_begin();
+
+    file_begin();
+
     for (;;) {
         serial_print_P(prompt);
         serial_read_line(input_buffer, &input_buffer_size, INPUT_BUFFER_SIZE);
@@ -98,6 +122,16 @@ int main(void) {
                     break;
                 }
             }
+            // A line of programs connected with | is a pipeline
+            if (!is_command_found) {
+                for (uint8_t i = 1; i < arguments_size; i++) {
+                    if (arguments[i] == pipe_argument) {
+                        is_command_found = true;
+                        job_start(arguments_size, arguments);
+                        break;
+                    }
+                }
+            }
             if (!is_command_found) {
                 serial_print_P(PSTR("Can't find command: "));
                 serial_println(arguments[0]);
@@ -0,0 +1,171 @@
+#include "pipe.h"
+#include "processes.h"
+#include <string.h>
+
+Pipe pipes[PIPE_SIZE];
+
+// A pipe stays after its last process closed it until its bytes are read,
+// so a writer can finish before the reader starts
+static bool pipe_used(int8_t pipe) {
+    return pipes[pipe].readers + pipes[pipe].writers != 0 || pipes[pipe].size != 0;
+}
+
+static int8_t pipe_alloc(char *name) {
+    for (int8_t i = 0; i < PIPE_SIZE; i++) {
+        if (!pipe_used(i)) {
+            strcpy(pipes[i].name, name);
+            pipes[i].closed = false;
+            pipes[i].broken = false;
+            pipes[i].position = 0;
+            pipes[i].size = 0;
+            pipes[i].reader = NULL;
+            pipes[i].transferred = 0;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int8_t pipe_open(char *name, uint8_t mode) {
+    if (
+        name[0] == '\0' || strlen(name) >= PIPE_NAME_SIZE ||
+        (mode != PIPE_OPEN_MODE_READ && mode != PIPE_OPEN_MODE_WRITE)
+    ) {
+        return -1;
+    }
+
+    int8_t pipe = -1;
+    for (int8_t i = 0; i < PIPE_SIZE; i++) {
+        if (pipe_used(i) && !strcmp(pipes[i].name, name)) {
+            pipe = i;
+            break;
+        }
+    }
+
+    // A pipe is created by the first process that opens it
+    if (pipe == -1) {
+        pipe = pipe_alloc(name);
+        if (pipe == -1) return -1;
+    }
+
+    if (mode == PIPE_OPEN_MODE_READ) {
+        pipes[pipe].readers++;
+        pipes[pipe].broken = false;
+    } else {
+        pipes[pipe].writers++;
+        pipes[pipe].closed = false;
+    }
+    return pipe;
+}
+
+// A pipe without name is opened once for reading and once for writing, the
+// shell gives its ends to the stages of a pipeline
+int8_t pipe_create(void) {
+    int8_t pipe = pipe_alloc("");
+    if (pipe != -1) {
+        pipes[pipe].readers = 1;
+        pipes[pipe].writers = 1;
+    }
+    return pipe;
+}
+
+int16_t pipe_read(int8_t pipe, struct Processor *reader, uint8_t *buffer, int16_t size) {
+    if (pipe >= 0 && pipe < PIPE_SIZE && pipes[pipe].readers != 0) {
+        Pipe *p = &pipes[pipe];
+        if (p->reader == reader && p->transferred != 0) {
+            int16_t bytes_read = p->transferred;
+            p->reader = NULL;
+            p->transferred = 0;
+            return bytes_read;
+        }
+        if (size <= 0) return 0;
+
+        if (p->size == 0) {
+            if (p->closed) return 0;
+            if (p->reader == NULL) {
+                p->reader = reader;
+                p->reader_buffer = buffer;
+                p->reader_size = size;
+            }
+            return PIPE_BLOCKED;
+        }
+
+        int16_t bytes_read = 0;
+        while (bytes_read < size && p->size != 0) {
+            buffer[bytes_read++] = p->buffer[p->position];
+            p->position = (p->position + 1) % PIPE_BUFFER_SIZE;
+            p->size--;
+        }
+        processes_event(PROCESSOR_EVENT_PIPE_WRITE);
+        return bytes_read;
+    }
+    return -1;
+}
+
+int16_t pipe_write(int8_t pipe, uint8_t *buffer, int16_t size) {
+    if (pipe >= 0 && pipe < PIPE_SIZE && pipes[pipe].writers != 0) {
+        Pipe *p = &pipes[pipe];
+        if (p->broken) return -1;
+        if (size <= 0) return 0;
+
+        // The bytes a waiting reader can take skip the ring buffer
+        int16_t bytes_written = 0;
+        if (p->reader != NULL && p->transferred == 0 && p->size == 0) {
+            bytes_written = size < p->reader_size ? size : p->reader_size;
+            memcpy(p->reader_buffer, buffer, bytes_written);
+            p->transferred = bytes_written;
+        } else if (p->size == PIPE_BUFFER_SIZE) {
+            return PIPE_BLOCKED;
+        }
+
+        while (bytes_written < size && p->size < PIPE_BUFFER_SIZE) {
+            p->buffer[(p->position + p->size) % PIPE_BUFFER_SIZE] = buffer[bytes_written++];
+            p->size++;
+        }
+        processes_event(PROCESSOR_EVENT_PIPE_READ);
+        return bytes_written;
+    }
+    return -1;
+}
+
+// Returns the bytes a read gets without waiting, a closed pipe that is empty
+// has one so a program reading it sees the end
+uint8_t pipe_available(int8_t pipe) {
+    if (pipe >= 0 && pipe < PIPE_SIZE) {
+        if (pipes[pipe].size == 0) return pipes[pipe].closed;
+        return pipes[pipe].size < 255 ? pipes[pipe].size : 255;
+    }
+    return 0;
+}
+
+// Returns true when a read or write that blocked can make progress
+bool pipe_pending(int8_t pipe, struct Processor *processor, uint8_t mode) {
+    if (pipe >= 0 && pipe < PIPE_SIZE) {
+        Pipe *p = &pipes[pipe];
+        if (mode == PIPE_OPEN_MODE_READ) {
+            return p->size != 0 || p->closed || (p->reader == processor && p->transferred != 0);
+        }
+        return p->size < PIPE_BUFFER_SIZE || p->broken || (p->reader != NULL && p->transferred == 0);
+    }
+    return true;
+}
+
+bool pipe_close(int8_t pipe, struct Processor *processor, uint8_t mode) {
+    if (pipe >= 0 && pipe < PIPE_SIZE) {
+        Pipe *p = &pipes[pipe];
+        if (mode == PIPE_OPEN_MODE_READ && p->readers != 0) {
+            if (p->reader == processor) {
+                p->reader = NULL;
+                p->transferred = 0;
+            }
+            if (--p->readers == 0) p->broken = true;
+        } else if (mode == PIPE_OPEN_MODE_WRITE && p->writers != 0) {
+            if (--p->writers == 0) p->closed = true;
+        } else {
+            return false;
+        }
+        processes_event(PROCESSOR_EVENT_PIPE_READ | PROCESSOR_EVENT_PIPE_WRITE);
+        return true;
+    }
+    return false;
+}
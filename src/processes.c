@@ -1,18 +1,361 @@
 #include "processes.h"
+#include "eeprom.h"
+#include "cache.h"
 #include "file.h"
+#include "pipe.h"
 #include "serial.h"
+#include "utils.h"
+#include <string.h>
+#ifdef ARDUINO
+    #include <avr/io.h>
+    #include <avr/interrupt.h>
+    #include <avr/sleep.h>
+    #include <util/atomic.h>
+#else
+    #include <pthread.h>
+    #include <time.h>
+    #include <unistd.h>
+#endif
 
 Process processes[PROCESSES_SIZE] = {0};
 
-int8_t process_open(char *name, bool debug) {
+ProcessImage processes_images[PROCESSES_SIZE] = {0};
+
+uint8_t processes_memory[PROCESSES_MEMORY];
+
+// The running processes wait in two arrays with a list for every niceness
+// level, the scheduler takes the next process from the highest level of the
+// active array and moves it to the expired array after its slice. When every
+// process had its slice the arrays swap, the bitmaps mark the levels that
+// have processes so picking the next one does not depend on their number
+ProcessList processes_ready[2][PROCESS_NICENESS_MAX];
+
+uint16_t processes_ready_bitmap[2];
+
+uint8_t processes_active;
+
+ProcessList processes_sleeping;
+
+// The processes that wait for an event of their program, the interrupts only
+// set the events that happened and the scheduler wakes the processes
+ProcessList processes_blocked;
+
+volatile uint8_t processes_events = 0;
+
+// The timer sets the tick every quantum and keeps the time, in cycles mode a
+// quantum is a number of cycles so the scheduling does not depend on time
+volatile bool processes_tick = false;
+
+uint16_t processes_quantum_size = PROCESSES_QUANTUM;
+
+bool processes_quantum_cycles = false;
+
+uint16_t processes_timer_period = PROCESSES_QUANTUM;
+
+#ifdef ARDUINO
+    // The milliseconds since the kernel started and the microseconds of the
+    // timer periods that do not make a millisecond yet
+    volatile uint32_t processes_time = 0;
+
+    uint16_t processes_time_micros = 0;
+#endif
+
+// The process that runs its quanta and how many it has left
+int8_t processes_current = -1;
+
+uint8_t processes_current_quanta;
+
+#ifndef ARDUINO
+    // The worker threads run the processes of the ready lists, everything a
+    // process needs from the kernel is queued in the kernel list and done by
+    // the shell thread, so only it touches the serial port, the files and
+    // the trace and profile buffers
+    ProcessList processes_kernel;
+
+    pthread_t processes_workers_threads[PROCESSES_WORKERS_MAX];
+
+    uint8_t processes_workers_size = 0;
+
+    bool processes_workers_stopping = false;
+
+    pthread_mutex_t processes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_cond_t processes_work = PTHREAD_COND_INITIALIZER;
+
+    pthread_cond_t processes_idle = PTHREAD_COND_INITIALIZER;
+
+    // Signals the shell thread when there are events or kernel work
+    pthread_cond_t processes_wakeup = PTHREAD_COND_INITIALIZER;
+
+    // The number of processes a worker is running and the number of shell
+    // thread calls that wait for them to stop
+    uint8_t processes_busy = 0;
+
+    uint8_t processes_pausing = 0;
+
+    pthread_t processes_timer_thread;
+#endif
+
+// The shell thread holds the lock while it changes processes, the workers
+// finish their slices before it gets it
+static void processes_lock(void) {
+    #ifndef ARDUINO
+        pthread_mutex_lock(&processes_mutex);
+        processes_pausing++;
+        while (processes_busy != 0) pthread_cond_wait(&processes_idle, &processes_mutex);
+        processes_pausing--;
+    #endif
+}
+
+static void processes_unlock(void) {
+    #ifndef ARDUINO
+        pthread_cond_broadcast(&processes_work);
+        pthread_mutex_unlock(&processes_mutex);
+    #endif
+}
+
+#ifdef ARDUINO
+    ISR(TIMER1_COMPA_vect) {
+        processes_tick = true;
+        processes_time_micros += processes_timer_period;
+        while (processes_time_micros >= 1000) {
+            processes_time_micros -= 1000;
+            processes_time++;
+        }
+        processes_events |= PROCESSOR_EVENT_TIMER;
+    }
+#else
+    static void *processes_timer(void *argument) {
+        (void)argument;
+        for (;;) {
+            pthread_mutex_lock(&processes_mutex);
+            uint16_t period = processes_timer_period;
+            pthread_mutex_unlock(&processes_mutex);
+
+            usleep(period);
+            processes_tick = true;
+            processes_event(PROCESSOR_EVENT_TIMER);
+        }
+        return NULL;
+    }
+#endif
+
+// Returns the milliseconds since the kernel started, only differences are
+// compared so it can wrap
+uint32_t processes_millis(void) {
+    #ifdef ARDUINO
+        uint32_t time;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            time = processes_time;
+        }
+        return time;
+    #else
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time.tv_sec * 1000UL + time.tv_nsec / 1000000;
+    #endif
+}
+
+void processes_event(uint8_t events) {
+    #ifdef ARDUINO
+        // The interrupts set events too, so the read modify write can not
+        // be interrupted
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            processes_events |= events;
+        }
+    #else
+        pthread_mutex_lock(&processes_mutex);
+        processes_events |= events;
+        pthread_cond_signal(&processes_wakeup);
+        pthread_mutex_unlock(&processes_mutex);
+    #endif
+}
+
+bool processes_quantum(uint16_t size, bool cycles) {
+    if (size == 0) return false;
+
+    // The timer also keeps the time, so in cycles mode it ticks every
+    // default quantum
+    uint16_t period = cycles ? PROCESSES_QUANTUM : size;
+    #ifdef ARDUINO
+        // Timer1 in clear timer on compare mode counts every 64 clocks
+        uint32_t counts = (uint32_t)period * (F_CPU / 1000000UL) / 64;
+        if (counts == 0 || counts > 0x10000) return false;
+        TIMSK1 = 0;
+    #endif
+
+    processes_lock();
+    processes_quantum_size = size;
+    processes_quantum_cycles = cycles;
+    processes_timer_period = period;
+    processes_tick = false;
+    processes_unlock();
+
+    #ifdef ARDUINO
+        TCCR1A = 0;
+        TCCR1B = 0;
+        TCNT1 = 0;
+        OCR1A = counts - 1;
+        TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+        TIMSK1 = _BV(OCIE1A);
+    #endif
+    return true;
+}
+
+void processes_begin(void) {
+    for (uint8_t i = 0; i < 2; i++) {
+        for (uint8_t j = 0; j < PROCESS_NICENESS_MAX; j++) {
+            processes_ready[i][j].head = -1;
+            processes_ready[i][j].tail = -1;
+        }
+        processes_ready_bitmap[i] = 0;
+    }
+    processes_active = 0;
+    processes_sleeping.head = -1;
+    processes_sleeping.tail = -1;
+    processes_blocked.head = -1;
+    processes_blocked.tail = -1;
+    #ifdef ARDUINO
+        set_sleep_mode(SLEEP_MODE_IDLE);
+    #else
+        processes_kernel.head = -1;
+        processes_kernel.tail = -1;
+        pthread_create(&processes_timer_thread, NULL, &processes_timer, NULL);
+    #endif
+    processes_quantum(PROCESSES_QUANTUM, false);
+}
+
+static void process_link(int8_t process, ProcessList *list) {
+    processes[process].list = list;
+    processes[process].next = -1;
+    processes[process].previous = list->tail;
+    if (list->tail != -1) {
+        processes[list->tail].next = process;
+    } else {
+        list->head = process;
+    }
+    list->tail = process;
+}
+
+static bool process_ready_list(ProcessList *list) {
+    return list >= &processes_ready[0][0] && list < &processes_ready[0][0] + 2 * PROCESS_NICENESS_MAX;
+}
+
+// A process that is run by a worker or waited on is in no list
+static void process_unlink(int8_t process) {
+    ProcessList *list = processes[process].list;
+    if (list == NULL) return;
+    if (processes[process].previous != -1) {
+        processes[processes[process].previous].next = processes[process].next;
+    } else {
+        list->head = processes[process].next;
+    }
+    if (processes[process].next != -1) {
+        processes[processes[process].next].previous = processes[process].previous;
+    } else {
+        list->tail = processes[process].previous;
+    }
+    processes[process].list = NULL;
+
+    if (list->head == -1 && process_ready_list(list)) {
+        uint8_t level = list - processes_ready[0];
+        bit_clear(processes_ready_bitmap[level / PROCESS_NICENESS_MAX], level % PROCESS_NICENESS_MAX);
+    }
+}
+
+static void process_ready(int8_t process, uint8_t array) {
+    uint8_t level = processes[process].niceness - 1;
+    process_link(process, &processes_ready[array][level]);
+    bit_set(processes_ready_bitmap[array], level);
+}
+
+// Finds the image of the program in a file or takes a free one, a program
+// that already runs keeps its image and the new file is closed again
+static int8_t process_image(int8_t file) {
+    int8_t free_image = -1;
+    for (int8_t i = 0; i < PROCESSES_SIZE; i++) {
+        if (processes_images[i].references != 0) {
+            if (files[processes_images[i].file].address == files[file].address) {
+                file_close(file);
+                processes_images[i].references++;
+                return i;
+            }
+        } else if (free_image == -1) {
+            free_image = i;
+        }
+    }
+
+    processes_images[free_image].file = file;
+    processes_images[free_image].references = 1;
+    #ifndef ARDUINO
+        processor_image_clear(&processes_images[free_image].processor);
+    #endif
+    return free_image;
+}
+
+// Takes the first free range of the memory pool that is big enough, the
+// RAM of the open processes are the used ranges
+static uint8_t *processes_memory_alloc(uint16_t size) {
+    uint16_t start = 0;
+    bool moved;
+    do {
+        if ((uint32_t)start + size > PROCESSES_MEMORY) return NULL;
+        moved = false;
+        for (uint8_t i = 0; i < PROCESSES_SIZE; i++) {
+            Processor *processor = &processes[i].processor;
+            if (processes[i].niceness != 0) {
+                uint16_t used = processor->ram - processes_memory;
+                if (start < used + processor->ram_size && used < start + size) {
+                    start = used + processor->ram_size;
+                    moved = true;
+                }
+            }
+        }
+    } while (moved);
+    return &processes_memory[start];
+}
+
+// Loads a program in a free slot without making it runnable, so its state
+// can be changed before a worker sees it
+static int8_t process_load(char *name, bool debug, uint16_t ram_size) {
     for (uint8_t i = 0; i < PROCESSES_SIZE; i++) {
         if (processes[i].niceness == 0) {
             int8_t file = file_open(name, FILE_OPEN_MODE_READ);
             if (file != -1) {
+                // A program runs from one run of blocks, its code is read
+                // from the EEPROM so the cache is synced first
+                uint16_t program = file_data(file);
+                if (program == 0) {
+                    file_close(file);
+                    return -1;
+                }
+                cache_sync();
+
+                // The RAM size of the header is used when none is given
+                if (files[file].size >= PROCESS_HEADER_SIZE && eeprom_read_word(program) == PROCESS_HEADER_MAGIC) {
+                    if (ram_size == 0) ram_size = eeprom_read_word(program + 2);
+                    program += PROCESS_HEADER_SIZE;
+                }
+                if (ram_size == 0) ram_size = PROCESSOR_RAM_SIZE;
+                uint8_t *ram = processes_memory_alloc(ram_size);
+                if (ram == NULL) {
+                    file_close(file);
+                    return -1;
+                }
+
+                int8_t image = process_image(file);
+                file = processes_images[image].file;
                 processes[i].niceness = 1;
                 processes[i].file = file;
+                processes[i].image = image;
+                processes[i].job = 0;
                 processes[i].state = PROCESS_STATE_RUNNING;
-                processor_init(&processes[i].processor, debug, files[file].address + 1 + files[file].name_size + 2); // DIRTY
+                processes[i].started = processes_millis();
+                processor_init(&processes[i].processor, debug, program, ram, ram_size);
+                processes[i].processor.pid = i;
+                #ifndef ARDUINO
+                    processes[i].processor.image = &processes_images[image].processor;
+                #endif
                 return i;
             } else {
                 return -1;
@@ -22,9 +365,25 @@ int8_t process_open(char *name, bool debug) {
     return -1;
 }
 
+int8_t process_open(char *name, bool debug, uint16_t ram_size) {
+    int8_t process = process_load(name, debug, ram_size);
+    if (process != -1) {
+        processes_lock();
+        process_ready(process, processes_active);
+        processes_unlock();
+    }
+    return process;
+}
+
 bool process_sleep(int8_t process) {
     if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
-        processes[process].state = PROCESS_STATE_SLEEPING;
+        processes_lock();
+        if (processes[process].state != PROCESS_STATE_SLEEPING) {
+            process_unlink(process);
+            process_link(process, &processes_sleeping);
+            processes[process].state = PROCESS_STATE_SLEEPING;
+        }
+        processes_unlock();
         return true;
     }
     return false;
@@ -32,7 +391,19 @@ bool process_sleep(int8_t process) {
 
 bool process_wake(int8_t process) {
     if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
-        processes[process].state = PROCESS_STATE_RUNNING;
+        processes_lock();
+        if (processes[process].state == PROCESS_STATE_SLEEPING) {
+            // A process that was blocked waits for its events again
+            process_unlink(process);
+            if (processes[process].processor.events != 0) {
+                process_link(process, &processes_blocked);
+                processes[process].state = PROCESS_STATE_BLOCKED;
+            } else {
+                process_ready(process, processes_active);
+                processes[process].state = PROCESS_STATE_RUNNING;
+            }
+        }
+        processes_unlock();
         return true;
     }
     return false;
@@ -40,34 +411,302 @@ bool process_wake(int8_t process) {
 
 bool process_niceness(int8_t process, uint8_t niceness) {
     if (niceness == 0) niceness = 1;
-    if (niceness > 10) niceness = 10;
+    if (niceness > PROCESS_NICENESS_MAX) niceness = PROCESS_NICENESS_MAX;
+
+    if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
+        // A ready process moves to the list of its new level
+        processes_lock();
+        if (process_ready_list(processes[process].list)) {
+            process_unlink(process);
+            processes[process].niceness = niceness;
+            process_ready(process, processes_active ^ 1);
+        } else {
+            processes[process].niceness = niceness;
+        }
+        processes_unlock();
+        return true;
+    }
+    return false;
+}
+
+bool process_jit(int8_t process, bool jit) {
+    #ifndef ARDUINO
+        if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
+            processes_lock();
+            processes[process].processor.jit = jit;
+            processes_unlock();
+            return true;
+        }
+    #else
+        (void)process;
+        (void)jit;
+    #endif
+    return false;
+}
 
+bool process_trace(int8_t process, bool trace) {
     if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
-        processes[process].niceness = niceness;
+        processes_lock();
+        processes[process].processor.trace = trace;
+        processes_unlock();
         return true;
     }
     return false;
 }
 
+bool process_profile(int8_t process, bool profile) {
+    #ifndef ARDUINO
+        if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
+            processes_lock();
+            if (profile) processor_profile_clear();
+            processes[process].processor.profile = profile;
+            processes_unlock();
+            return true;
+        }
+    #else
+        (void)process;
+        (void)profile;
+    #endif
+    return false;
+}
+
+bool process_stats(int8_t process, ProcessStats *stats) {
+    if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
+        Processor *processor = &processes[process].processor;
+        processes_lock();
+        stats->cycles = processor->cycles;
+        stats->instructions = processor->instructions;
+        stats->syscalls = 0;
+        for (uint8_t i = 0; i < PROCESSOR_SYSCALLS_SIZE; i++) stats->syscalls += processor->syscalls[i];
+        stats->bytes_read = processor->bytes_read;
+        stats->bytes_written = processor->bytes_written;
+        stats->stack = PROCESSOR_RAM_START + processor->ram_size - 1 - processor->stack_low;
+        stats->ram = processor->ram_size;
+        processes_unlock();
+        stats->runtime = stats->cycles / (PROCESSOR_FREQUENCY / 1000);
+        stats->wall = processes_millis() - processes[process].started;
+
+        uint32_t cycles = stats->cycles;
+        uint32_t instructions = stats->instructions;
+        while (cycles > 0xffffff) {
+            cycles >>= 1;
+            instructions >>= 1;
+        }
+        stats->ipc = cycles != 0 ? instructions * 100 / cycles : 0;
+        return true;
+    }
+    return false;
+}
+
+// Runs a process until it used its cycles or stopped, the syscall vectors
+// it calls are handled here so they count as an instruction for the budget
+static ProcessorState process_syscall(int8_t process) {
+    Processor *processor = &processes[process].processor;
+    ProcessorState state = processor_syscall(processor);
+    if (state == PROCESSOR_STATE_BLOCKED && (processor->events & PROCESSOR_EVENT_TIMER) != 0) {
+        processes[process].wake = processes_millis() + processor->delay;
+    }
+    return state;
+}
+
+// Returns true when an event a blocked process waits for has happened, the
+// serial input is checked without polling it because that reports events
+static bool process_pending(int8_t process) {
+    uint8_t events = processes[process].processor.events;
+    if ((events & PROCESSOR_EVENT_SERIAL) != 0 && serial_input_write_position != serial_input_read_position) return true;
+    if ((events & PROCESSOR_EVENT_TIMER) != 0 && (int32_t)(processes_millis() - processes[process].wake) >= 0) return true;
+    Processor *processor = &processes[process].processor;
+    if ((events & PROCESSOR_EVENT_PIPE_READ) != 0 && pipe_pending(processor->pipe, processor, PIPE_OPEN_MODE_READ)) return true;
+    if ((events & PROCESSOR_EVENT_PIPE_WRITE) != 0 && pipe_pending(processor->pipe, processor, PIPE_OPEN_MODE_WRITE)) return true;
+    if ((events & PROCESSOR_EVENT_EEPROM) != 0 && eeprom_pending() == 0) return true;
+    return false;
+}
+
+static void process_block(int8_t process) {
+    processes_lock();
+    process_unlink(process);
+    process_link(process, &processes_blocked);
+    processes[process].state = PROCESS_STATE_BLOCKED;
+    processes_unlock();
+}
+
+// Moves the blocked processes that have their events to the ready lists,
+// the list is only walked when an interrupt reported an event
+static void processes_unblock(void) {
+    #ifdef ARDUINO
+        uint8_t events;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            events = processes_events;
+            processes_events = 0;
+        }
+    #else
+        pthread_mutex_lock(&processes_mutex);
+        uint8_t events = processes_events;
+        processes_events = 0;
+    #endif
+
+    if (events != 0) {
+        int8_t process = processes_blocked.head;
+        while (process != -1) {
+            int8_t next = processes[process].next;
+            if (process_pending(process)) {
+                processes[process].processor.events = 0;
+                process_unlink(process);
+                process_ready(process, processes_active);
+                processes[process].state = PROCESS_STATE_RUNNING;
+            }
+            process = next;
+        }
+    }
+
+    #ifndef ARDUINO
+        pthread_cond_broadcast(&processes_work);
+        pthread_mutex_unlock(&processes_mutex);
+    #endif
+}
+
+// Waits until an interrupt happens when there is nothing to run, the device
+// sleeps and the timer and serial interrupts wake it
+static void processes_wait_event(void) {
+    #ifdef ARDUINO
+        cli();
+        if (processes_events == 0 && serial_available() == 0) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
+    #else
+        if (serial_available() != 0) return;
+        pthread_mutex_lock(&processes_mutex);
+        if (processes_events == 0 && processes_kernel.head == -1) {
+            struct timespec time;
+            clock_gettime(CLOCK_REALTIME, &time);
+            time.tv_nsec += processes_timer_period * 1000L;
+            if (time.tv_nsec >= 1000000000L) {
+                time.tv_sec++;
+                time.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&processes_wakeup, &processes_mutex, &time);
+        }
+        pthread_mutex_unlock(&processes_mutex);
+    #endif
+}
+
+// Finds the next process in the ready lists, a process gets more quanta
+// and runs earlier in a round the higher its niceness is
+static int8_t processes_peek(void) {
+    if (processes_ready_bitmap[processes_active] == 0) {
+        if (processes_ready_bitmap[processes_active ^ 1] == 0) return -1;
+        processes_active ^= 1;
+    }
+
+    uint8_t level = sizeof(unsigned int) * 8 - 1 - __builtin_clz(processes_ready_bitmap[processes_active]);
+    return processes_ready[processes_active][level].head;
+}
+
+// Returns true when the shell thread has an other process to run, with
+// workers they run the ready processes themselves
+static bool processes_others_ready(void) {
+    #ifndef ARDUINO
+        if (processes_workers_size != 0) return false;
+    #endif
+    return processes_peek() != -1;
+}
+
+static ProcessorState process_run(int8_t process, uint32_t cycles) {
+    Processor *processor = &processes[process].processor;
+    ProcessorState state = processor_run(processor, cycles);
+    if (state == PROCESSOR_STATE_SYSCALL) state = process_syscall(process);
+
+    // The debugger runs one instruction at a time and prints what it did
+    // from the trace ring
+    if (processor->debug) {
+        ProcessorTrace *trace = processor_trace_get(0);
+        if (trace != NULL) processor_trace_print(trace);
+    }
+    return state;
+}
+
+// Runs one instruction of a process under the debugger
+static ProcessorState process_step(int8_t process) {
+    return process_run(process, 1);
+}
+
+// The other processes get a quantum every time the timer ticks while the
+// shell is busy, the tick that ends their quantum is taken too so the shell
+// gets the next period. When no other process is ready the shell keeps
+// running and does not sleep
+void processes_yield(void) {
+    #ifndef ARDUINO
+        if (processes_workers_size != 0) processes_kernel_run();
+    #endif
+
+    if (processes_tick || processes_quantum_cycles) {
+        processes_unblock();
+        if (processes_others_ready()) processes_run();
+        processes_tick = false;
+    }
+}
+
 bool process_wait(int8_t process) {
     if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
+        // The waited on process is run by the shell thread only
+        processes_lock();
+        process_unlink(process);
+        processes[process].state = PROCESS_STATE_RUNNING;
+        processes_unlock();
+
         bool runToClose = false;
         while (processes[process].processor.running) {
-            processor_clock(&processes[process].processor);
+            // The stop key puts the process to sleep and gives the shell back
+            if (
+                !processes[process].processor.debug && serial_available() != 0 &&
+                serial_input_buffer[serial_input_read_position % SERIAL_INPUT_BUFFER_SIZE] == PROCESS_STOP_KEY
+            ) {
+                serial_read();
+                process_sleep(process);
+                return true;
+            }
+
+            processes_yield();
 
-            if (!runToClose && processes[process].processor.debug) {
-                while (serial_available() == 0);
+            // A blocked process does not run until its events happened, the
+            // other processes run or the shell waits for an interrupt
+            if (processes[process].processor.events != 0) {
+                if (!process_pending(process)) {
+                    processes_run();
+                    continue;
+                }
+                processes[process].processor.events = 0;
+            }
+
+            if (!processes[process].processor.debug) {
+                // A break instruction stops the process in the debugger
+                if (process_run(process, PROCESS_WAIT_CYCLES) == PROCESSOR_STATE_BREAK) {
+                    serial_println_P(PSTR("Process break!"));
+                    processes[process].processor.debug = true;
+                    processes[process].processor.trace = true;
+                }
+                continue;
+            }
+
+            process_step(process);
+
+            if (!runToClose) {
+                while (serial_available() == 0) processes_run();
                 char character = serial_read();
 
                 if (character == 's') {
                     while (
-                        processor_clock(&processes[process].processor) != PROCESSOR_STATE_CALL &&
+                        process_step(process) != PROCESSOR_STATE_CALL &&
                         processes[process].processor.running
                     );
                 }
                 if (character == 'e') {
                     while (
-                        processor_clock(&processes[process].processor) != PROCESSOR_STATE_RETURN &&
+                        process_step(process) != PROCESSOR_STATE_RETURN &&
                         processes[process].processor.running
                     );
                 }
@@ -80,29 +719,441 @@ bool process_wait(int8_t process) {
             }
         }
         process_close(process);
+        return true;
+    }
+    return false;
+}
+
+// Connects the serial output of a process to the serial input of the next
+// through a pipe that is closed with them
+bool process_pipe(int8_t process, int8_t next) {
+    if (
+        process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0 &&
+        next >= 0 && next < PROCESSES_SIZE && processes[next].niceness != 0
+    ) {
+        int8_t pipe = pipe_create();
+        if (pipe == -1) return false;
+        processes[process].processor.output = pipe;
+        processes[process].processor.pipes_write |= 1 << pipe;
+        processes[next].processor.input = pipe;
+        processes[next].processor.pipes_read |= 1 << pipe;
+        return true;
     }
     return false;
 }
 
 bool process_close(int8_t process) {
     if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
+        processes_lock();
+        process_unlink(process);
         processes[process].niceness = 0;
-        file_close(processes[process].file);
+        // A new process in the slot must not get the quanta that are left
+        if (processes_current == process) processes_current = -1;
+        processes_unlock();
+        if (--processes_images[processes[process].image].references == 0) {
+            file_close(processes[process].file);
+        }
+
+        // The files and pipes the program did not close are closed with it
+        Processor *processor = &processes[process].processor;
+        for (uint8_t i = 0; i < FILE_SIZE; i++) {
+            if ((processor->files & (1 << i)) != 0) file_close(i);
+        }
+        for (uint8_t i = 0; i < PIPE_SIZE; i++) {
+            if ((processor->pipes_read & (1 << i)) != 0) pipe_close(i, processor, PIPE_OPEN_MODE_READ);
+            if ((processor->pipes_write & (1 << i)) != 0) pipe_close(i, processor, PIPE_OPEN_MODE_WRITE);
+        }
         return true;
     }
     return false;
 }
 
-void processes_run(void) {
+static bool process_checkpoint_write(int8_t file, uint32_t value, uint8_t size) {
+    uint8_t bytes[4];
+    for (uint8_t i = 0; i < size; i++) bytes[i] = value >> (i * 8);
+    return file_write(file, bytes, size) == size;
+}
+
+static bool process_checkpoint_read(int8_t file, uint32_t *value, uint8_t size) {
+    uint8_t bytes[4];
+    if (file_read(file, bytes, size) != size) return false;
+    *value = 0;
+    for (uint8_t i = 0; i < size; i++) *value |= (uint32_t)bytes[i] << (i * 8);
+    return true;
+}
+
+// Takes a process out of the scheduler so its state can be saved or loaded
+// without the lock, a worker never has it while the shell thread does this
+static ProcessList *process_hold(int8_t process) {
+    processes_lock();
+    ProcessList *list = processes[process].list;
+    process_unlink(process);
+    processes_unlock();
+    return list;
+}
+
+static void process_release(int8_t process, ProcessList *list) {
+    processes_lock();
+    if (process_ready_list(list)) {
+        process_ready(process, processes_active ^ 1);
+    } else if (list != NULL) {
+        process_link(process, list);
+    }
+    processes_unlock();
+}
+
+// A checkpoint file holds the name of the program, the processor state and
+// the files of the program with their positions. The numbers are stored
+// little endian so a checkpoint can be resumed on the device and the host,
+// a program with open pipes can not be stored because they live in RAM
+bool process_checkpoint(int8_t process, char *name) {
+    if (process >= 0 && process < PROCESSES_SIZE && processes[process].niceness != 0) {
+        if (processes[process].processor.pipes_read != 0 || processes[process].processor.pipes_write != 0) return false;
+
+        char program[PROCESS_NAME_SIZE];
+        if (!file_name(processes[process].file, program, sizeof(program))) return false;
+
+        int8_t file = file_open(name, FILE_OPEN_MODE_WRITE);
+        if (file == -1) return false;
+
+        ProcessList *list = process_hold(process);
+        Processor *p = &processes[process].processor;
+        processor_flags_update(p);
+        uint8_t program_size = strlen(program);
+        bool written = file_write(file, (uint8_t *)PROCESS_CHECKPOINT_MAGIC, 4) == 4 &&
+            process_checkpoint_write(file, PROCESSOR_RAM_START + p->ram_size, 2) &&
+            process_checkpoint_write(file, program_size, 1) &&
+            file_write(file, (uint8_t *)program, program_size) == program_size &&
+            process_checkpoint_write(file, processes[process].niceness, 1) &&
+            process_checkpoint_write(file, p->pc, 2) &&
+            process_checkpoint_write(file, p->sp, 2) &&
+            process_checkpoint_write(file, p->sreg.data, 1) &&
+            process_checkpoint_write(file, p->cycles, 4) &&
+            process_checkpoint_write(file, p->instructions, 4) &&
+            process_checkpoint_write(file, p->pipe_written, 2) &&
+            file_write(file, p->data, PROCESSOR_RAM_START) == PROCESSOR_RAM_START &&
+            file_write(file, p->ram, p->ram_size) == (int16_t)p->ram_size;
+
+        for (uint8_t i = 0; i < FILE_SIZE && written; i++) {
+            if ((p->files & (1 << i)) != 0) {
+                char file_name_buffer[PROCESS_NAME_SIZE];
+                if (!file_name(i, file_name_buffer, sizeof(file_name_buffer))) {
+                    written = false;
+                    break;
+                }
+                uint8_t size = strlen(file_name_buffer);
+                written = process_checkpoint_write(file, i, 1) &&
+                    process_checkpoint_write(file, files[i].mode, 1) &&
+                    process_checkpoint_write(file, size, 1) &&
+                    file_write(file, (uint8_t *)file_name_buffer, size) == size &&
+                    process_checkpoint_write(file, files[i].position, 2);
+            }
+        }
+        process_release(process, list);
+        file_close(file);
+        return written;
+    }
+    return false;
+}
+
+// Moves a file of the kernel to a free slot, returns the new slot or -1
+static int8_t process_file_move(int8_t file) {
+    for (int8_t i = 0; i < FILE_SIZE; i++) {
+        if (files[i].address == 0) {
+            files[i] = files[file];
+            files[file].address = 0;
+            for (uint8_t j = 0; j < PROCESSES_SIZE; j++) {
+                if (processes_images[j].references != 0 && processes_images[j].file == file) processes_images[j].file = i;
+                if (processes[j].niceness != 0 && processes[j].file == file) processes[j].file = i;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+int8_t process_resume(char *name) {
+    int8_t file = file_open(name, FILE_OPEN_MODE_READ);
+    if (file == -1) return -1;
+
+    char magic[4];
+    uint32_t data_size, value;
+    char program[PROCESS_NAME_SIZE];
+    if (
+        file_read(file, (uint8_t *)magic, 4) != 4 || memcmp(magic, PROCESS_CHECKPOINT_MAGIC, 4) != 0 ||
+        !process_checkpoint_read(file, &data_size, 2) || data_size <= PROCESSOR_RAM_START ||
+        !process_checkpoint_read(file, &value, 1) || value >= PROCESS_NAME_SIZE ||
+        file_read(file, (uint8_t *)program, value) != (int16_t)value
+    ) {
+        file_close(file);
+        return -1;
+    }
+    program[value] = '\0';
+
+    int8_t process = process_load(program, false, data_size - PROCESSOR_RAM_START);
+    if (process == -1) {
+        file_close(file);
+        return -1;
+    }
+
+    Processor *p = &processes[process].processor;
+    uint32_t niceness, pc, sp, sreg, cycles, instructions, pipe_written;
+    bool loaded = process_checkpoint_read(file, &niceness, 1) &&
+        process_checkpoint_read(file, &pc, 2) &&
+        process_checkpoint_read(file, &sp, 2) &&
+        process_checkpoint_read(file, &sreg, 1) &&
+        process_checkpoint_read(file, &cycles, 4) &&
+        process_checkpoint_read(file, &instructions, 4) &&
+        process_checkpoint_read(file, &pipe_written, 2) &&
+        file_read(file, p->data, PROCESSOR_RAM_START) == PROCESSOR_RAM_START &&
+        file_read(file, p->ram, p->ram_size) == (int16_t)p->ram_size;
+    if (loaded) {
+        p->pc = pc;
+        p->sp = sp;
+        p->stack_low = sp;
+        p->sreg.data = sreg;
+        p->lazy.pending = 0;
+        p->cycles = cycles;
+        p->instructions = instructions;
+        p->pipe_written = pipe_written;
+    }
+
+    // The program keeps the numbers of its files, so they are opened again
+    // in the same slots. A file that was opened for writing is opened for
+    // appending, so what the program wrote is not truncated
+    uint32_t slot;
+    while (loaded && process_checkpoint_read(file, &slot, 1)) {
+        char file_name_buffer[PROCESS_NAME_SIZE];
+        uint32_t mode, size, position;
+
+        // The checkpoint and the program images are opened by the kernel, so
+        // they move out of the way of a file of the program
+        if (slot < FILE_SIZE && files[slot].address != 0) {
+            bool kernel = (int8_t)slot == file;
+            for (uint8_t i = 0; i < PROCESSES_SIZE; i++) {
+                if (processes_images[i].references != 0 && processes_images[i].file == (int8_t)slot) kernel = true;
+            }
+            int8_t moved = kernel ? process_file_move(slot) : -1;
+            if (moved != -1 && (int8_t)slot == file) file = moved;
+        }
+
+        loaded = slot < FILE_SIZE && files[slot].address == 0 &&
+            process_checkpoint_read(file, &mode, 1) && mode <= FILE_OPEN_MODE_APPEND &&
+            process_checkpoint_read(file, &size, 1) && size < PROCESS_NAME_SIZE &&
+            file_read(file, (uint8_t *)file_name_buffer, size) == (int16_t)size &&
+            process_checkpoint_read(file, &position, 2);
+        if (loaded) {
+            file_name_buffer[size] = '\0';
+            int8_t reopened = file_open(file_name_buffer, mode == FILE_OPEN_MODE_WRITE ? FILE_OPEN_MODE_APPEND : mode);
+            loaded = reopened != -1;
+            if (loaded && reopened != (int8_t)slot) {
+                files[slot] = files[reopened];
+                files[reopened].address = 0;
+            }
+            if (loaded) {
+                files[slot].mode = mode;
+                file_seek(slot, position);
+                p->files |= 1 << slot;
+            }
+        }
+    }
+    file_close(file);
+
+    if (!loaded) {
+        process_close(process);
+        return -1;
+    }
+    process_niceness(process, niceness);
+    processes_lock();
+    process_ready(process, processes_active);
+    processes_unlock();
+    return process;
+}
+
+// A program reads its code and program data from the EEPROM and not through
+// the cache. The cache is synced when a program is loaded and here, the file
+// system calls this every time it changes the blocks of a file, so the
+// EEPROM always has the code of a file that has an image
+void processes_invalidate(uint16_t address) {
+    processes_lock();
     for (uint8_t i = 0; i < PROCESSES_SIZE; i++) {
-        if (processes[i].niceness != 0 && processes[i].state == PROCESS_STATE_RUNNING) {
-            for (int16_t j = 0; j < processes[i].niceness << 4; j++) {
-                processor_clock(&processes[i].processor);
-                if (!processes[i].processor.running) {
-                    process_close(i);
-                    continue;
+        if (processes_images[i].references != 0 && files[processes_images[i].file].address == address) {
+            cache_sync();
+            #ifndef ARDUINO
+                processor_image_clear(&processes_images[i].processor);
+            #endif
+        }
+    }
+    processes_unlock();
+}
+
+static int8_t processes_next(void) {
+    int8_t process = processes_peek();
+    if (process != -1) process_unlink(process);
+    return process;
+}
+
+// Runs a process for one quantum, returns false when it stopped or went to
+// sleep so it must not be put back in the ready lists
+static bool process_quantum(int8_t process) {
+    processes_tick = false;
+    uint32_t start = processes[process].processor.cycles;
+    uint32_t used = 0;
+    for (;;) {
+        uint16_t budget = processes_quantum_cycles ? processes_quantum_size - used : PROCESS_TICK_CYCLES;
+        ProcessorState state = process_run(process, budget);
+        if (!processes[process].processor.running) {
+            process_close(process);
+            return false;
+        }
+
+        // A background process that hits a break instruction sleeps
+        // until it is woken or waited on in the debugger
+        if (state == PROCESSOR_STATE_BREAK) {
+            serial_println_P(PSTR("Process break!"));
+            process_sleep(process);
+            return false;
+        }
+
+        if (state == PROCESSOR_STATE_BLOCKED) {
+            process_block(process);
+            return false;
+        }
+
+        if (processes_quantum_cycles) {
+            used = processes[process].processor.cycles - start;
+            if (used >= processes_quantum_size) return true;
+        } else if (processes_tick) {
+            return true;
+        }
+    }
+}
+
+#ifndef ARDUINO
+    // A worker only runs a process until it needs the kernel, the debugger
+    // or the trace and profile buffers, it leaves the rest to the shell thread
+    static void *processes_worker(void *argument) {
+        (void)argument;
+        pthread_mutex_lock(&processes_mutex);
+        for (;;) {
+            int8_t process = -1;
+            while (!processes_workers_stopping && (processes_pausing != 0 || (process = processes_next()) == -1)) {
+                pthread_cond_wait(&processes_work, &processes_mutex);
+            }
+            if (processes_workers_stopping) break;
+
+            Processor *processor = &processes[process].processor;
+            ProcessorState state = PROCESSOR_STATE_NORMAL;
+            bool kernel = processor->debug || processor->trace || processor->profile;
+            if (!kernel) {
+                processes_busy++;
+                pthread_mutex_unlock(&processes_mutex);
+                state = processor_run(processor, processes[process].niceness * PROCESS_WORKER_CYCLES);
+                pthread_mutex_lock(&processes_mutex);
+                if (--processes_busy == 0) pthread_cond_broadcast(&processes_idle);
+                kernel = state == PROCESSOR_STATE_SYSCALL || state == PROCESSOR_STATE_BREAK || !processor->running;
+            }
+
+            if (kernel) {
+                processes[process].event = state;
+                process_link(process, &processes_kernel);
+                pthread_cond_signal(&processes_wakeup);
+            } else {
+                process_ready(process, processes_active ^ 1);
+            }
+        }
+        pthread_mutex_unlock(&processes_mutex);
+        return NULL;
+    }
+
+    // Does the work the workers queued for the shell thread
+    void processes_kernel_run(void) {
+        for (;;) {
+            pthread_mutex_lock(&processes_mutex);
+            int8_t process = processes_kernel.head;
+            if (process != -1) process_unlink(process);
+            pthread_mutex_unlock(&processes_mutex);
+            if (process == -1) return;
+
+            bool ready = true;
+            ProcessorState state = processes[process].event;
+            if (state == PROCESSOR_STATE_SYSCALL) {
+                if (process_syscall(process) == PROCESSOR_STATE_BLOCKED) {
+                    process_block(process);
+                    ready = false;
                 }
+            } else if (state == PROCESSOR_STATE_NORMAL) {
+                ready = process_quantum(process);
+            } else if (!processes[process].processor.running) {
+                process_close(process);
+                ready = false;
+            } else {
+                serial_println_P(PSTR("Process break!"));
+                process_sleep(process);
+                ready = false;
+            }
+
+            if (ready) {
+                processes_lock();
+                process_ready(process, processes_active ^ 1);
+                processes_unlock();
             }
         }
     }
+
+    bool processes_workers(uint8_t size) {
+        if (size > PROCESSES_WORKERS_MAX) return false;
+
+        pthread_mutex_lock(&processes_mutex);
+        processes_workers_stopping = true;
+        pthread_cond_broadcast(&processes_work);
+        pthread_mutex_unlock(&processes_mutex);
+        for (uint8_t i = 0; i < processes_workers_size; i++) {
+            pthread_join(processes_workers_threads[i], NULL);
+        }
+        processes_workers_stopping = false;
+        processes_kernel_run();
+
+        processes_workers_size = 0;
+        while (processes_workers_size < size) {
+            if (pthread_create(&processes_workers_threads[processes_workers_size], NULL, &processes_worker, NULL) != 0) {
+                return false;
+            }
+            processes_workers_size++;
+        }
+        return true;
+    }
+#endif
+
+void processes_run(void) {
+    processes_unblock();
+
+    #ifndef ARDUINO
+        if (processes_workers_size != 0) {
+            processes_kernel_run();
+            processes_wait_event();
+            return;
+        }
+    #endif
+
+    // The process at the head of the ready lists keeps it for all its quanta,
+    // the shell checks its input between them so it stays responsive no
+    // matter how many processes there are
+    int8_t process = processes_peek();
+    if (process == -1) {
+        processes_wait_event();
+        return;
+    }
+    if (process != processes_current) {
+        processes_current = process;
+        processes_current_quanta = processes[process].niceness;
+    }
+
+    if (!process_quantum(process)) {
+        processes_current = -1;
+    } else if (--processes_current_quanta == 0) {
+        processes_current = -1;
+        process_unlink(process);
+        process_ready(process, processes_active ^ 1);
+    }
 }
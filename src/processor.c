@@ -3,917 +3,1763 @@
 #include "utils.h"
 #include "serial.h"
 #include "eeprom.h"
+#include "cache.h"
 #include "file.h"
+#include "pipe.h"
 
-void processor_init(Processor *p, bool debug, uint16_t pgm_address) {
+#if FILE_SIZE > 8
+    #error "The files a program opened must fit in a byte"
+#endif
+
+#if PIPE_SIZE > 8
+    #error "The pipes a program opened must fit in a byte"
+#endif
+
+void processor_init(Processor *p, bool debug, uint16_t pgm_address, uint8_t *ram, uint16_t ram_size) {
     p->running = true;
     p->debug = debug;
+    p->trace = debug;
     p->pc = 0;
-    for (uint8_t i = 0; i < 32; i++) p->r[i] = 0;
-    p->sp = 0x20 + 0x40 + sizeof(p->ram) - 1;
+    for (uint8_t i = 0; i < PROCESSOR_RAM_START; i++) p->data[i] = 0;
+    p->ram = ram;
+    p->ram_size = ram_size;
+    for (uint16_t i = 0; i < ram_size; i++) ram[i] = 0;
+    p->sp = PROCESSOR_RAM_START + ram_size - 1;
     p->sreg.data = 0;
-    for (uint8_t i = 0; i < 128; i++) p->ram[i] = 0;
+    p->lazy.pending = 0;
     p->pgm_address = pgm_address;
-    p->clock_ticks = 0;
+    p->cycles = 0;
+    p->instructions = 0;
+    p->events = 0;
+    for (uint8_t i = 0; i < PROCESSOR_SYSCALLS_SIZE; i++) p->syscalls[i] = 0;
+    p->bytes_read = 0;
+    p->bytes_written = 0;
+    p->stack_low = p->sp;
+    p->files = 0;
+    p->pipes_read = 0;
+    p->pipes_write = 0;
+    p->pipe_written = 0;
+    p->input = -1;
+    p->output = -1;
+    #ifndef ARDUINO
+        p->image = NULL;
+        p->jit = false;
+        p->profile = false;
+    #endif
+}
+
+#ifndef ARDUINO
+    void processor_image_clear(ProcessorImage *image) {
+        for (uint16_t i = 0; i < PROCESSOR_IMAGE_SIZE; i++) {
+            image->decoded[i] = PROCESSOR_IMAGE_EMPTY;
+            image->block_index[i] = PROCESSOR_BLOCK_EMPTY;
+        }
+        image->blocks_size = 0;
+    }
+#endif
+
+#ifndef ARDUINO
+    ProcessorProfile processor_profile;
+
+    void processor_profile_clear(void) {
+        processor_profile.instructions = 0;
+        for (uint8_t i = 0; i < PROCESSOR_CLASSES_SIZE; i++) processor_profile.classes[i] = 0;
+        for (uint16_t i = 0; i < PROCESSOR_PROFILE_SIZE; i++) processor_profile.counts[i] = 0;
+    }
+
+    static void processor_profile_count(uint16_t pc, uint8_t class) {
+        processor_profile.instructions++;
+        processor_profile.classes[class]++;
+        if ((pc >> 1) < PROCESSOR_PROFILE_SIZE) processor_profile.counts[pc >> 1]++;
+    }
+#endif
+
+ProcessorTrace processor_trace[PROCESSOR_TRACE_SIZE];
+
+uint16_t processor_trace_position = 0;
+
+uint16_t processor_trace_size = 0;
+
+void processor_trace_clear(void) {
+    processor_trace_position = 0;
+    processor_trace_size = 0;
+}
+
+static ProcessorTrace *processor_trace_begin(Processor *p, uint16_t instruction, uint8_t flags) {
+    ProcessorTrace *trace = &processor_trace[processor_trace_position];
+    processor_trace_position = (processor_trace_position + 1) & (PROCESSOR_TRACE_SIZE - 1);
+    if (processor_trace_size < PROCESSOR_TRACE_SIZE) processor_trace_size++;
+
+    trace->pid = p->pid;
+    trace->pc = p->pc;
+    trace->instruction = instruction;
+    trace->flags = flags;
+    trace->reg = 0xff;
+    return trace;
+}
+
+static void processor_trace_access(uint8_t flags, uint16_t address, uint8_t data) {
+    ProcessorTrace *trace = &processor_trace[(processor_trace_position - 1) & (PROCESSOR_TRACE_SIZE - 1)];
+    trace->flags |= flags;
+    trace->address = address;
+    trace->data = data;
+}
+
+// Returns the trace entry index places back from the newest one
+ProcessorTrace *processor_trace_get(uint16_t index) {
+    if (index >= processor_trace_size) return NULL;
+    return &processor_trace[(processor_trace_position - 1 - index) & (PROCESSOR_TRACE_SIZE - 1)];
+}
+
+void processor_trace_print(ProcessorTrace *trace) {
+    printf_P(PSTR("pid:%d pc:%04x %02x %02x"), trace->pid, trace->pc, trace->instruction & 0xff, trace->instruction >> 8);
+    if ((trace->flags & PROCESSOR_TRACE_SYSCALL) != 0) {
+        printf_P(PSTR(" syscall"));
+    }
+    if (trace->reg != 0xff) {
+        printf_P(PSTR(" r%d = %02x"), trace->reg, trace->reg_data);
+    }
+    if ((trace->flags & (PROCESSOR_TRACE_READ | PROCESSOR_TRACE_WRITE)) != 0) {
+        printf_P(PSTR(" %" PRIpstr " mem[0x%04x] = %02x (%c)"), (trace->flags & PROCESSOR_TRACE_WRITE) != 0 ? PSTR("WRITE") : PSTR("READ"),
+            trace->address, trace->data, (trace->data >= ' ' && trace->data <= '~') ? trace->data : '.');
+    }
+    printf_P(PSTR("\n"));
+}
+
+// The stack pointer and status register are kept outside the data space, so
+// only their I/O addresses need decoding on a memory access
+#define PROCESSOR_IO_SPL (0x20 + 0x3d)
+#define PROCESSOR_IO_SPH (0x20 + 0x3e)
+#define PROCESSOR_IO_SREG (0x20 + 0x3f)
+
+// The stack pointer has as many bits as the end of the RAM needs, but at
+// least the ten bits of the default layout
+static uint16_t processor_sp_mask(Processor *p) {
+    uint16_t mask = 0b1111111111;
+    while (mask < PROCESSOR_RAM_START + p->ram_size - 1) mask = (mask << 1) | 1;
+    return mask;
+}
+
+static uint8_t processor_read_io(Processor *p, uint16_t addr) {
+    if (addr == PROCESSOR_IO_SPL) return p->sp & 0xff;
+    if (addr == PROCESSOR_IO_SPH) return (p->sp & processor_sp_mask(p)) >> 8;
+    processor_flags_update(p);
+    return p->sreg.data;
+}
+
+static void processor_write_io(Processor *p, uint16_t addr, uint8_t data) {
+    if (addr == PROCESSOR_IO_SPL || addr == PROCESSOR_IO_SPH) {
+        if (addr == PROCESSOR_IO_SPL) {
+            p->sp = (p->sp & 0xff00) | data;
+        } else {
+            p->sp = ((data << 8) & processor_sp_mask(p)) | (p->sp & 0xff);
+        }
+        if (p->sp < p->stack_low) p->stack_low = p->sp;
+    } else {
+        p->lazy.pending = 0;
+        p->sreg.data = data;
+    }
 }
 
 uint8_t processor_read(Processor *p, uint16_t addr) {
     uint8_t data;
-    if (addr < 0x20) data = p->r[addr];
-    else if (addr == 0x20 + 0x3d) data = p->sp & 0xff;
-    else if (addr == 0x20 + 0x3e) data = (p->sp >> 8) &0b11;
-    else if (addr == 0x20 + 0x3f) data = p->sreg.data;
-    else if (addr >= 0x20 + 0x40 && (uint16_t)(addr - 0x20 - 0x40) < sizeof(p->ram)) data = p->ram[addr - 0x20 - 0x40];
+    if ((uint16_t)(addr - PROCESSOR_IO_SPL) < 3) data = processor_read_io(p, addr);
+    else if (addr < PROCESSOR_RAM_START) data = p->data[addr];
+    else if ((uint16_t)(addr - PROCESSOR_RAM_START) < p->ram_size) data = p->ram[addr - PROCESSOR_RAM_START];
     else data = 0;
-    if (p->debug) printf_P(PSTR("READ mem[0x%04x] = %02x (%c)\n"), addr, data, (data >= ' ' && data <= '~') ? data : '.');
+    if (p->trace) processor_trace_access(PROCESSOR_TRACE_READ, addr, data);
     return data;
 }
 
 void processor_write(Processor *p, uint16_t addr, uint8_t data) {
-    if (addr < 0x20) p->r[addr] = data;
-    if (addr == 0x20 + 0x3d) p->sp = (p->sp & 0b1100000000) | data;
-    if (addr == 0x20 + 0x3e) p->sp = ((data & 0b11) << 8) | (p->sp & 0xff);
-    if (addr == 0x20 + 0x3f) p->sreg.data = data;
-    if (addr >= 0x20 + 0x40 && (uint16_t)(addr - 0x20 - 0x40) < sizeof(p->ram)) p->ram[addr - 0x20 - 0x40] = data;
-    if (p->debug) printf_P(PSTR("WRITE mem[0x%04x] = %02x (%c)\n"), addr, data, (data >= ' ' && data <= '~') ? data : '.');
-}
-
-void processor_flags(Processor *p, uint8_t data, bool sub_zero_carry, bool overflow) {
-    if (sub_zero_carry) {
-        if (data != 0) {
-            p->sreg.flags.z = false;
-        }
-    } else {
-        p->sreg.flags.z = data == 0;
-    }
-    p->sreg.flags.n = bit(data, 7);
-    p->sreg.flags.v = overflow;
-    p->sreg.flags.s = p->sreg.flags.n != p->sreg.flags.v;
+    if ((uint16_t)(addr - PROCESSOR_IO_SPL) < 3) processor_write_io(p, addr, data);
+    else if (addr < PROCESSOR_RAM_START) p->data[addr] = data;
+    else if ((uint16_t)(addr - PROCESSOR_RAM_START) < p->ram_size) p->ram[addr - PROCESSOR_RAM_START] = data;
+    if (p->trace) processor_trace_access(PROCESSOR_TRACE_WRITE, addr, data);
 }
 
-bool processor_add(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c) {
-    #ifdef __builtin_add_overflow
-        bool carry_out = __builtin_add_overflow(a, b + carry_in, c);
-    #else
-        *c = a + (b + carry_in);
-        bool carry_out = (int16_t)a + (int16_t)(b + carry_in) > (int16_t)0xff;
-    #endif
-    processor_flags(p, *c, false, carry_in != carry_out);
-    return carry_out;
+// Pushes a byte on the guest stack and remembers how deep the stack got
+static void processor_push(Processor *p, uint8_t data) {
+    processor_write(p, p->sp--, data);
+    if (p->sp < p->stack_low) p->stack_low = p->sp;
 }
-void processor_add_with_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c) {
-    p->sreg.flags.c = processor_add(p, a, b, carry_in, c);
+
+// The sreg bits the flag setting instructions change
+#define PROCESSOR_FLAGS_CZ 0b00000011
+#define PROCESSOR_FLAGS_ZNVS 0b00011110
+#define PROCESSOR_FLAGS_CZNVS 0b00011111
+#define PROCESSOR_FLAGS_HCZNVS 0b00111111
+
+// The carry out of the stored operation is kept in bit 8 of the result and
+// the operands xor the result gives the carries into every bit, so the half
+// carry is bit 4 of it and the overflow flag is the carry into bit 7 compared
+// to the carry out. The shift instructions store zero operands so the overflow
+// flag becomes N xor C, the logic instructions store their result so it is
+// cleared
+static bool processor_flags_zero(Processor *p) {
+    return (p->lazy.result & 0xff) == 0 && p->lazy.zero;
 }
-void processor_add_with_half_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c) {
-    p->sreg.flags.h = (int8_t)(a & 0b1111) + (int8_t)((b & 0b1111) + carry_in) > (int8_t)0xf;
-    processor_add_with_carry(p, a, b, carry_in, c);
+
+static void processor_flags_evaluate(Processor *p, uint8_t mask) {
+    bool negative = bit(p->lazy.result, 7);
+    bool overflow = bit((p->lazy.half ^ p->lazy.result), 7) != bit(p->lazy.result, 8);
+    uint8_t flags = bit(p->lazy.result, 8) | (processor_flags_zero(p) << PROCESSOR_FLAG_Z) |
+        (negative << PROCESSOR_FLAG_N) | (overflow << PROCESSOR_FLAG_V) | ((negative != overflow) << PROCESSOR_FLAG_S) |
+        (bit((p->lazy.half ^ p->lazy.result), 4) << PROCESSOR_FLAG_H);
+    p->sreg.data = (p->sreg.data & ~mask) | (flags & mask);
+    p->lazy.pending &= ~mask;
 }
 
-bool processor_sub(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c, bool zero_carry) {
-    #ifdef __builtin_sub_overflow
-        bool carry_out = __builtin_sub_overflow(a, b + carry_in, c);
-    #else
-        *c = a - (b + carry_in);
-        bool carry_out = (int16_t)a - (int16_t)(b + carry_in) < (int16_t)0;
-    #endif
-    processor_flags(p, *c, zero_carry, carry_in != carry_out);
-    return carry_out;
+void processor_flags(Processor *p, uint8_t mask, uint16_t result, uint8_t half, bool zero_carry) {
+    // The zero flag of a zero carry operation also depends on the previous
+    // one, like for sbc, sbci and cpc
+    bool zero = true;
+    if (zero_carry) {
+        zero = bit(p->lazy.pending, PROCESSOR_FLAG_Z) ? processor_flags_zero(p) : p->sreg.flags.z;
+    }
+
+    // The bits of the previous operation that this one leaves alone are
+    // computed before its operands are overwritten
+    uint8_t keep = p->lazy.pending & ~mask;
+    if (keep != 0) processor_flags_evaluate(p, keep);
+
+    p->lazy.pending = mask;
+    p->lazy.result = result;
+    p->lazy.half = half;
+    p->lazy.zero = zero;
+}
+
+bool processor_flag(Processor *p, uint8_t flag) {
+    if (bit(p->lazy.pending, flag)) processor_flags_evaluate(p, 1 << flag);
+    return bit(p->sreg.data, flag);
+}
+
+bool processor_carry(Processor *p) {
+    if (bit(p->lazy.pending, PROCESSOR_FLAG_C)) return bit(p->lazy.result, 8);
+    return p->sreg.flags.c;
+}
+
+void processor_flags_update(Processor *p) {
+    if (p->lazy.pending != 0) processor_flags_evaluate(p, p->lazy.pending);
 }
-void processor_sub_with_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c, bool zero_carry) {
-    p->sreg.flags.c = processor_sub(p, a, b, carry_in, c, zero_carry);
+
+uint8_t processor_add(Processor *p, uint8_t a, uint8_t b, bool carry, uint8_t mask) {
+    uint16_t result = a + (b + carry);
+    processor_flags(p, mask, result, a ^ b, false);
+    return result & 0xff;
 }
-void processor_sub_with_half_carry(Processor *p, uint8_t a, uint8_t b, bool carry_in, uint8_t *c, bool zero_carry) {
-    p->sreg.flags.h = (int8_t)(a & 0b1111) - (int8_t)((b & 0b1111) + carry_in) < (int8_t)0;
-    processor_sub_with_carry(p, a, b, carry_in, c, zero_carry);
+
+uint8_t processor_sub(Processor *p, uint8_t a, uint8_t b, bool carry, uint8_t mask, bool zero_carry) {
+    uint16_t result = a - (b + carry);
+    processor_flags(p, mask, result, a ^ b, zero_carry);
+    return result & 0xff;
 }
 
 const PROGMEM char output_string[] = "OUTPUT: ";
 
-ProcessorState processor_clock(Processor *p) {
-    if (!p->running) return PROCESSOR_STATE_HALTED;
+// Returns the host address of a guest data address for the syscalls that
+// get a string or a buffer
+static uint8_t *processor_pointer(Processor *p, uint16_t addr) {
+    if (addr < PROCESSOR_RAM_START) return &p->data[addr];
+    return &p->ram[addr - PROCESSOR_RAM_START];
+}
 
-    uint16_t i = eeprom_read_word(p->pgm_address + p->pc);
+// Limits the size of a guest buffer to the end of the registers or the RAM
+// it starts in, because they are not next to each other on the host. A size
+// of -1 is the length of the string in the buffer
+static uint16_t processor_buffer_size(Processor *p, uint16_t addr, uint16_t size) {
+    uint16_t end = addr < PROCESSOR_RAM_START ? PROCESSOR_RAM_START : PROCESSOR_RAM_START + p->ram_size;
+    if (addr >= end) return 0;
+    uint16_t limit = end - addr;
+    if (size == 0xffff) {
+        uint8_t *string = processor_pointer(p, addr);
+        size = 0;
+        while (size < limit && string[size] != '\0') size++;
+    }
+    return size < limit ? size : limit;
+}
 
-    uint16_t *X = (uint16_t *)&p->r[26];
-    uint16_t *Y = (uint16_t *)&p->r[28];
-    uint16_t *Z = (uint16_t *)&p->r[30];
+// Returns the host address of a guest string, NULL when it does not end in
+// the registers or the RAM it starts in, so its length is the room there
+static char *processor_string(Processor *p, uint16_t addr) {
+    if (processor_buffer_size(p, addr, 0xffff) == processor_buffer_size(p, addr, 0xfffe)) return NULL;
+    return (char *)processor_pointer(p, addr);
+}
+
+// Prints a guest string to the serial port, up to the end of the registers
+// or the RAM it starts in
+static void processor_print(Processor *p, uint16_t addr) {
+    uint8_t *string = processor_pointer(p, addr);
+    uint16_t size = processor_buffer_size(p, addr, 0xffff);
+    for (uint16_t i = 0; i < size; i++) {
+        serial_write(string[i]);
+    }
+}
 
-    if (p->debug) {
-        printf_P(PSTR("%04d pc:%04x regs:"), p->clock_ticks++, p->pc);
-        for (uint8_t i = 0; i < 26; i++) {
-            printf_P(PSTR("%02x "), p->r[i]);
+// Writes the serial output of a program to its output pipe, from where a
+// blocked write stopped. The string is in the buffer or at a program address
+// when the buffer is NULL. Returns false when the program must wait for room
+// in the pipe, output nobody reads anymore is dropped
+static bool processor_output(Processor *p, uint8_t *buffer, uint16_t address, uint16_t size, bool newline) {
+    while (p->pipe_written < size + newline) {
+        uint8_t character = '\n';
+        if (p->pipe_written < size && buffer == NULL) character = eeprom_read_byte(address + p->pipe_written);
+        int16_t bytes = p->pipe_written < size && buffer != NULL
+            ? pipe_write(p->output, buffer + p->pipe_written, size - p->pipe_written)
+            : pipe_write(p->output, &character, 1);
+        if (bytes == PIPE_BLOCKED) {
+            p->events = PROCESSOR_EVENT_PIPE_WRITE;
+            p->pipe = p->output;
+            return false;
         }
-        printf_P(PSTR("X:%04x Y:%04x Z:%04x sp:%04x "), *X, *Y, *Z, p->sp);
-        printf_P(PSTR("sreg:%c%c%c%c%c%c%c%c |"),
-            p->sreg.flags.i ? 'I' : '-',
-            p->sreg.flags.t ? 'T' : '-',
-            p->sreg.flags.h ? 'H' : '-',
-            p->sreg.flags.s ? 'S' : '-',
-            p->sreg.flags.v ? 'V' : '-',
-            p->sreg.flags.n ? 'N' : '-',
-            p->sreg.flags.z ? 'Z' : '-',
-            p->sreg.flags.c ? 'C' : '-');
-        printf_P(PSTR(" %02x %02x  "), i & 0xff, i >> 8);
-    }
-
-    // ###############################################################################
-    // ########################## SPECIAL FUNCTION VECTORS ###########################
-    // ###############################################################################
-
-    if (p->pc >= 2 && p->pc <= 26) {
-        // ### Serial API ###
-
-        // serial_write
-        if (p->pc == 2) {
-            char character = p->r[24];
-            if (p->debug) printf_P(PSTR("serial_write(0x%02x)\n"), character);
+        if (bytes < 0) break;
+        p->pipe_written += bytes;
+    }
+    p->pipe_written = 0;
+    return true;
+}
+
+// Returns the length of a string at a program address
+static uint16_t processor_string_size_P(uint16_t address) {
+    uint16_t size = 0;
+    while (eeprom_read_byte(address + size) != '\0') size++;
+    return size;
+}
+
+// ###############################################################################
+// ########################## SPECIAL FUNCTION VECTORS ###########################
+// ###############################################################################
+
+ProcessorState processor_syscall(Processor *p) {
+    #ifndef ARDUINO
+        if (p->profile) processor_profile_count(p->pc, PROCESSOR_CLASS_SYSCALL);
+    #endif
+    if (p->trace) processor_trace_begin(p, 0, PROCESSOR_TRACE_SYSCALL);
 
+    // ### Serial API ###
+
+    // serial_write
+    if (p->pc == 2) {
+        char character = p->r[24];
+        if (p->debug) printf_P(PSTR("serial_write(0x%02x)\n"), character);
+
+        if (p->output != -1) {
+            if (!processor_output(p, &p->r[24], 0, 1, false)) return PROCESSOR_STATE_BLOCKED;
+        } else {
             if (p->debug) serial_print_P(output_string);
             serial_write(character);
             if (p->debug) serial_write('\n');
         }
+    }
 
-        // serial_print
-        if (p->pc == 4) {
-            uint16_t string = (p->r[25] << 8) | p->r[24];
-            if (p->debug) printf_P(PSTR("serial_print(0x%04x)\n"), string);
+    // serial_print
+    if (p->pc == 4) {
+        uint16_t string = (p->r[25] << 8) | p->r[24];
+        if (p->debug) printf_P(PSTR("serial_print(0x%04x)\n"), string);
 
+        if (p->output != -1) {
+            if (!processor_output(p, processor_pointer(p, string), 0, processor_buffer_size(p, string, 0xffff), false)) return PROCESSOR_STATE_BLOCKED;
+        } else {
             if (p->debug) serial_print_P(output_string);
-            serial_print((char *)&p->ram[string - 0x20 - 0x40]);
+            processor_print(p, string);
             if (p->debug) serial_write('\n');
         }
+    }
 
-        // serial_print_P
-        if (p->pc == 6) {
-            uint16_t string = (p->r[25] << 8) | p->r[24];
-            if (p->debug) printf_P(PSTR("serial_print_P(0x%04x)\n"), string);
+    // serial_print_P
+    if (p->pc == 6) {
+        uint16_t string = (p->r[25] << 8) | p->r[24];
+        if (p->debug) printf_P(PSTR("serial_print_P(0x%04x)\n"), string);
 
+        uint16_t position = p->pgm_address + string;
+        if (p->output != -1) {
+            if (!processor_output(p, NULL, position, processor_string_size_P(position), false)) return PROCESSOR_STATE_BLOCKED;
+        } else {
             if (p->debug) serial_print_P(output_string);
-            uint16_t position = p->pgm_address + string;
             char character;
             while ((character = eeprom_read_byte(position++)) != '\0') {
                 serial_write(character);
             }
             if (p->debug) serial_write('\n');
         }
+    }
 
-        // serial_println
-        if (p->pc == 8) {
-            uint16_t string = (p->r[25] << 8) | p->r[24];
-            if (p->debug) printf_P(PSTR("serial_println(0x%04x)\n"), string);
+    // serial_println
+    if (p->pc == 8) {
+        uint16_t string = (p->r[25] << 8) | p->r[24];
+        if (p->debug) printf_P(PSTR("serial_println(0x%04x)\n"), string);
 
+        if (p->output != -1) {
+            if (!processor_output(p, processor_pointer(p, string), 0, processor_buffer_size(p, string, 0xffff), true)) return PROCESSOR_STATE_BLOCKED;
+        } else {
             if (p->debug) serial_print_P(output_string);
-            serial_println((char *)&p->ram[string - 0x20 - 0x40]);
+            processor_print(p, string);
+            serial_write('\n');
         }
+    }
 
-        // serial_println_P
-        if (p->pc == 10) {
-            uint16_t string = (p->r[25] << 8) | p->r[24];
-            if (p->debug) printf_P(PSTR("serial_println_P(0x%04x)\n"), string);
+    // serial_println_P
+    if (p->pc == 10) {
+        uint16_t string = (p->r[25] << 8) | p->r[24];
+        if (p->debug) printf_P(PSTR("serial_println_P(0x%04x)\n"), string);
 
+        uint16_t position = p->pgm_address + string;
+        if (p->output != -1) {
+            if (!processor_output(p, NULL, position, processor_string_size_P(position), true)) return PROCESSOR_STATE_BLOCKED;
+        } else {
             if (p->debug) serial_print_P(output_string);
-            uint16_t position = p->pgm_address + string;
             char character;
             while ((character = eeprom_read_byte(position++)) != '\0') {
                 serial_write(character);
             }
             serial_write('\n');
         }
+    }
 
-        // ### File API ###
-
-        // file_open
-        if (p->pc == 12) {
-            uint16_t file_name = (p->r[25] << 8) | p->r[24];
-            uint8_t file_mode = p->r[22];
-            if (p->debug) printf_P(PSTR("file_open(0x%04x, %d)\n"), file_name, file_mode);
-
-            p->r[24] = file_open((char *)&p->ram[file_name - 0x20 - 0x40], file_mode);
-        }
+    // ### File API ###
 
-        #ifndef ARDUINO
-            // file_name
-            if (p->pc == 14) {
-                int8_t file = p->r[24];
-                uint16_t buffer = (p->r[23] << 8) | p->r[22];
-                if (p->debug) printf_P(PSTR("file_name(%d, 0x%04x)\n"), file, buffer);
+    // file_open
+    if (p->pc == 12) {
+        uint16_t file_name = (p->r[25] << 8) | p->r[24];
+        uint8_t file_mode = p->r[22];
+        if (p->debug) printf_P(PSTR("file_open(0x%04x, %d)\n"), file_name, file_mode);
 
-                p->r[24] = file_name(file, (char *)&p->ram[buffer - 0x20 - 0x40]);
-            }
+        char *name = processor_string(p, file_name);
+        int8_t file = name != NULL ? file_open(name, file_mode) : -1;
+        if (file != -1) p->files |= 1 << file;
+        p->r[24] = file;
+    }
 
-            // file_size
-            if (p->pc == 16) {
-                int8_t file = p->r[24];
-                if (p->debug) printf_P(PSTR("file_size(%d)\n"), file);
+    #ifndef ARDUINO
+        // file_name
+        if (p->pc == 14) {
+            int8_t file = p->r[24];
+            uint16_t buffer = (p->r[23] << 8) | p->r[22];
+            if (p->debug) printf_P(PSTR("file_name(%d, 0x%04x)\n"), file, buffer);
 
-                int16_t size = file_size(file);
-                p->r[24] = size & 0xff;
-                p->r[25] = size >> 8;
-            }
+            // A name has at most 255 characters
+            p->r[24] = file_name(file, (char *)processor_pointer(p, buffer), processor_buffer_size(p, buffer, 256));
+        }
 
-            // file_position
-            if (p->pc == 18) {
-                int8_t file = p->r[24];
-                if (p->debug) printf_P(PSTR("file_position(%d)\n"), file);
+        // file_size
+        if (p->pc == 16) {
+            int8_t file = p->r[24];
+            if (p->debug) printf_P(PSTR("file_size(%d)\n"), file);
 
-                int16_t position = file_position(file);
-                p->r[24] = position & 0xff;
-                p->r[25] = position >> 8;
-            }
+            int16_t size = file_size(file);
+            p->r[24] = size & 0xff;
+            p->r[25] = size >> 8;
+        }
 
-            // file_seek
-            if (p->pc == 20) {
-                int8_t file = p->r[24];
-                int16_t position = (p->r[23] << 8) | p->r[22];
-                if (p->debug) printf_P(PSTR("file_name(%d, 0x%04x)\n"), file, position);
+        // file_position
+        if (p->pc == 18) {
+            int8_t file = p->r[24];
+            if (p->debug) printf_P(PSTR("file_position(%d)\n"), file);
 
-                p->r[24] = file_seek(file, position);
-            }
+            int16_t position = file_position(file);
+            p->r[24] = position & 0xff;
+            p->r[25] = position >> 8;
+        }
 
-            // file_read
-            if (p->pc == 22) {
-                int8_t file = p->r[24];
-                uint16_t buffer = (p->r[23] << 8) | p->r[22];
-                uint16_t size = (p->r[21] << 8) | p->r[20];
-                if (p->debug) printf_P(PSTR("file_read(%d, 0x%04x, 0x%04x)\n"), file, buffer, size);
+        // file_seek
+        if (p->pc == 20) {
+            int8_t file = p->r[24];
+            int16_t position = (p->r[23] << 8) | p->r[22];
+            if (p->debug) printf_P(PSTR("file_name(%d, 0x%04x)\n"), file, position);
 
-                int16_t bytes_read = file_read(file, &p->ram[buffer - 0x20 - 0x40], size);
-                p->r[24] = bytes_read & 0xff;
-                p->r[25] = bytes_read >> 8;
-            }
-        #endif
+            p->r[24] = file_seek(file, position);
+        }
 
-        // file_write
-        if (p->pc == 24) {
+        // file_read
+        if (p->pc == 22) {
             int8_t file = p->r[24];
             uint16_t buffer = (p->r[23] << 8) | p->r[22];
             uint16_t size = (p->r[21] << 8) | p->r[20];
-            if (p->debug) printf_P(PSTR("file_write(%d, 0x%04x, 0x%04x)\n"), file, buffer, size);
+            if (p->debug) printf_P(PSTR("file_read(%d, 0x%04x, 0x%04x)\n"), file, buffer, size);
 
-            int16_t bytes_written = file_write(file, &p->ram[buffer - 0x20 - 0x40], size);
-            p->r[24] = bytes_written & 0xff;
-            p->r[25] = bytes_written >> 8;
+            int16_t bytes_read = file_read(file, processor_pointer(p, buffer), processor_buffer_size(p, buffer, size));
+            if (bytes_read > 0) p->bytes_read += bytes_read;
+            p->r[24] = bytes_read & 0xff;
+            p->r[25] = bytes_read >> 8;
         }
+    #endif
 
-        // file_close
-        if (p->pc == 26) {
-            int8_t file = p->r[24];
-            if (p->debug) printf_P(PSTR("file_close(%d)\n"), file);
+    // file_write, on the device a program blocks while the cache has dirty
+    // lines that do not fit in the EEPROM queue, so its write does not wait
+    // for the EEPROM when it evicts them. The other processes run while the
+    // EEPROM programs the queue
+    if (p->pc == 24) {
+        int8_t file = p->r[24];
+        uint16_t buffer = (p->r[23] << 8) | p->r[22];
+        uint16_t size = (p->r[21] << 8) | p->r[20];
+        if (p->debug) printf_P(PSTR("file_write(%d, 0x%04x, 0x%04x)\n"), file, buffer, size);
+
+        #ifdef ARDUINO
+            if (!cache_flush()) {
+                p->events = PROCESSOR_EVENT_EEPROM;
+                return PROCESSOR_STATE_BLOCKED;
+            }
+        #endif
 
-            p->r[24] = file_close(file);
-        }
+        int16_t bytes_written = file_write(file, processor_pointer(p, buffer), processor_buffer_size(p, buffer, size));
+        if (bytes_written > 0) p->bytes_written += bytes_written;
+        p->r[24] = bytes_written & 0xff;
+        p->r[25] = bytes_written >> 8;
+    }
+
+    // file_close
+    if (p->pc == 26) {
+        int8_t file = p->r[24];
+        if (p->debug) printf_P(PSTR("file_close(%d)\n"), file);
 
-        p->pc = processor_read(p, ++p->sp);
-        p->pc |= (processor_read(p, ++p->sp) << 8);
-        return PROCESSOR_STATE_RETURN;
+        if (file >= 0 && file < FILE_SIZE) p->files &= ~(1 << file);
+        p->r[24] = file_close(file);
     }
 
-    // ###############################################################################
-    // ############################# INSTRUCTION DECODING ############################
-    // ###############################################################################
+    // ### Event API ###
 
-    p->pc += 2;
+    // serial_available
+    if (p->pc == 28) {
+        if (p->debug) printf_P(PSTR("serial_available()\n"));
 
-    // Registers
-    uint8_t Rd = (i >> 4) & 0b11111; // register data: 0000 000d dddd 0000
-    uint8_t Rdu = ((i >> 4) & 0b1111) + 16; // register data upper: 0000 0000 dddd 0000
-    uint8_t Rdw = ((i >> 4) & 0b1111) << 1; // register data word: 0000 0000 dddd 0000
-    uint8_t Rdwp = (((i >> 4) & 0b11) << 1) + 24; // register data word pair: 0000 0000 00dd 0000
-    uint8_t Rr = (bit(i, 9) << 4) | (i & 0b1111); // register read: 0000 00r0 0000 rrrr
-    uint8_t Rrw = (i & 0b1111) << 1; // register read word: 0000 0000 0000 rrrr
-
-    // Data
-    uint8_t K = ((i >> 4) & 0b11110000) | (i & 0b1111); // data: 0000 KKKK 0000 KKKK
-    uint8_t K6 = ((i >> 2) & 0b110000) | (i & 0b1111); // data 6 bits: 0000 0000 KK00 KKKK
-
-    // Addresses
-    int16_t k = (i & 0b111111111111) << 1; // pgm address: 0000 kkkk kkkk kkkk
-    if (bit(k, 12)) k |= 0b1110000000000000;
-    int16_t k7 = (i >> 2) & 0b11111110; // pgm address: 0000 00kk kkkk k000
-    if (bit(k7, 7)) k7 |= 0b1111111110000000;
-
-    // IO registers
-    uint8_t A = ((i >> 5) & 0b110000) | (i & 0b1111); // io register: 0000 0AA0 0000 AAAA
-    uint8_t Al = (i >> 3) & 0b11111; // io register: 0000 0000 AAAA A000
-
-    // Bits
-    uint8_t b = i & 0b111; // bit: 0000 0000 0000 0bbb
-    uint8_t s = (i >> 4) & 0b111; // bit: 0000 0000 0sss 0000
-
-    // ###############################################################################
-    // ###################### ARITHMETIC AND LOGIC INSTRUCTIONS ######################
-    // ###############################################################################
-
-    // add Rd, Rr | adc Rd, Rr | 000c 11rd dddd rrrr
-    if ((i & 0b1110110000000000) == 0b0000110000000000) {
-        bool carry = bit(i, 12);
-
-        if (Rd == Rr) {
-            // lsl Rd | 0000 11dd dddd dddd
-            if (!carry) {
-                if (p->debug) printf_P(PSTR("lsl r%d (0x%02x)\n"), Rd, p->r[Rd]);
-                p->sreg.flags.c = bit(p->r[Rd], 7);
-                p->r[Rd] <<= 1;
-
-                p->sreg.flags.n = bit(p->r[Rd], 7);
-                processor_flags(p, p->r[Rd], false, p->sreg.flags.n != p->sreg.flags.c);
-                return PROCESSOR_STATE_NORMAL;
-            }
+        p->r[24] = p->input != -1 ? pipe_available(p->input) : serial_available();
+    }
 
-            // rol Rd | 0001 11dd dddd dddd
-            if (p->debug) printf_P(PSTR("rol r%d (0x%02x)\n"), Rd, p->r[Rd]);
-            bool old_carry = p->sreg.flags.c;
-            p->sreg.flags.c = bit(p->r[Rd], 7);
-            p->r[Rd] <<= 1;
-            p->r[Rd] |= old_carry;
+    // serial_read, a program without input blocks and runs the vector again
+    // when it is woken. The input of a pipeline stage ends with -1
+    if (p->pc == 30) {
+        if (p->debug) printf_P(PSTR("serial_read()\n"));
 
-            p->sreg.flags.n = bit(p->r[Rd], 7);
-            processor_flags(p, p->r[Rd], false, p->sreg.flags.n != p->sreg.flags.c);
-            return PROCESSOR_STATE_NORMAL;
+        if (p->input != -1) {
+            int16_t bytes = pipe_read(p->input, p, &p->r[24], 1);
+            if (bytes == PIPE_BLOCKED) {
+                p->events = PROCESSOR_EVENT_PIPE_READ;
+                p->pipe = p->input;
+                return PROCESSOR_STATE_BLOCKED;
+            }
+            if (bytes <= 0) p->r[24] = 0xff;
+        } else {
+            if (serial_available() == 0) {
+                p->events = PROCESSOR_EVENT_SERIAL;
+                return PROCESSOR_STATE_BLOCKED;
+            }
+            p->r[24] = serial_read();
         }
-
-        if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), r%d (0x%02x)\n"), carry ? PSTR("adc") : PSTR("add"), Rd, p->r[Rd], Rr, p->r[Rr]);
-        processor_add_with_half_carry(p, p->r[Rd], p->r[Rr], carry ? p->sreg.flags.c : false, &p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
     }
 
-    // adiw Rd, K | 1001 0110 KKdd KKKK
-    if ((i & 0b1111111100000000) == 0b1001011000000000) {
-        if (p->debug) printf_P(PSTR("adiw r%d (0x%02x%02x), 0x%02x\n"), Rdwp, p->r[Rdwp + 1], p->r[Rdwp], K6);
-        processor_add_with_carry(p, p->r[Rdwp], K6, false, &p->r[Rdwp]);
-        processor_add_with_carry(p, p->r[Rdwp + 1], 0, p->sreg.flags.c, &p->r[Rdwp + 1]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+    // delay
+    if (p->pc == 32) {
+        p->delay = (p->r[25] << 8) | p->r[24];
+        if (p->debug) printf_P(PSTR("delay(%u)\n"), p->delay);
 
-    // sub Rd, Rr | sbc Rd, Rr | 000c 10rd dddd rrrr
-    if ((i & 0b1110110000000000) == 0b0000100000000000) {
-        bool carry = bit(i, 12) == 0;
-        if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), r%d (0x%02x)\n"), carry ? PSTR("sbc") : PSTR("sub"), Rd, p->r[Rd], Rr, p->r[Rr]);
-        processor_sub_with_half_carry(p, p->r[Rd], p->r[Rr], carry ? p->sreg.flags.c : false, &p->r[Rd], carry);
-        return PROCESSOR_STATE_NORMAL;
+        p->events = PROCESSOR_EVENT_TIMER;
     }
 
-    // subi Rd, K | sbci Rd, K | 010c KKKK dddd KKKK
-    if ((i & 0b1110000000000000) == 0b0100000000000000) {
-        bool carry = bit(i, 12) == 0;
-        if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), 0x%02x\n"), carry ? PSTR("sbci") : PSTR("subi"), Rdu, p->r[Rdu], K);
-        processor_sub_with_half_carry(p, p->r[Rdu], K, carry ? p->sreg.flags.c : false, &p->r[Rdu], carry);
-        return PROCESSOR_STATE_NORMAL;
-    }
+    // ### Pipe API ###
 
-    // sbiw Rd, K | 1001 0111 KKdd KKKK
-    if ((i & 0b1111111100000000) == 0b1001011100000000) {
-        if (p->debug) printf_P(PSTR("sbiw r%d (0x%02x%02x), 0x%02x\n"), Rdwp, p->r[Rdwp + 1], p->r[Rdwp], K6);
-        processor_sub_with_carry(p, p->r[Rdwp], K6, false, &p->r[Rdwp], false);
-        processor_sub_with_carry(p, p->r[Rdwp + 1], 0, p->sreg.flags.c, &p->r[Rdwp + 1], false);
-        return PROCESSOR_STATE_NORMAL;
-    }
+    // pipe_open
+    if (p->pc == 34) {
+        uint16_t pipe_name = (p->r[25] << 8) | p->r[24];
+        uint8_t pipe_mode = p->r[22];
+        if (p->debug) printf_P(PSTR("pipe_open(0x%04x, %d)\n"), pipe_name, pipe_mode);
 
-    // and Rd, Rr | 0010 00rd dddd rrrr
-    if ((i & 0b1111110000000000) == 0b0010000000000000) {
-        if (p->debug) printf_P(PSTR("and r%d (0x%02x), r%d (0x%02x)\n"), Rd, p->r[Rd], Rr, p->r[Rr]);
-        p->r[Rd] &= p->r[Rr];
-        processor_flags(p, p->r[Rd], false, false);
-        return PROCESSOR_STATE_NORMAL;
+        char *name = processor_string(p, pipe_name);
+        int8_t pipe = name != NULL ? pipe_open(name, pipe_mode) : -1;
+        if (pipe != -1) {
+            if (pipe_mode == PIPE_OPEN_MODE_READ) p->pipes_read |= 1 << pipe;
+            else p->pipes_write |= 1 << pipe;
+        }
+        p->r[24] = pipe;
+    }
+
+    // pipe_read and pipe_write, a program blocks while the pipe is empty or
+    // full and runs the vector again when it is woken. A read returns the
+    // bytes that are there, a write returns when all bytes are written
+    if (p->pc == 36 || p->pc == 38) {
+        int8_t pipe = p->r[24];
+        uint16_t buffer = (p->r[23] << 8) | p->r[22];
+        uint16_t size = (p->r[21] << 8) | p->r[20];
+        bool read = p->pc == 36;
+        if (p->debug) printf_P(read ? PSTR("pipe_read(%d, 0x%04x, 0x%04x)\n") : PSTR("pipe_write(%d, 0x%04x, 0x%04x)\n"), pipe, buffer, size);
+
+        int16_t bytes = -1;
+        if (pipe >= 0 && pipe < PIPE_SIZE && ((read ? p->pipes_read : p->pipes_write) & (1 << pipe)) != 0) {
+            uint8_t *pointer = processor_pointer(p, buffer);
+            size = processor_buffer_size(p, buffer, size);
+            if (read) {
+                bytes = pipe_read(pipe, p, pointer, size);
+            } else {
+                bytes = pipe_write(pipe, pointer + p->pipe_written, size - p->pipe_written);
+                if (bytes >= 0) {
+                    p->pipe_written += bytes;
+                    bytes = p->pipe_written < size ? PIPE_BLOCKED : (int16_t)size;
+                } else if (bytes == -1 && p->pipe_written != 0) {
+                    bytes = p->pipe_written;
+                }
+                if (bytes != PIPE_BLOCKED) p->pipe_written = 0;
+            }
+        }
+        if (bytes == PIPE_BLOCKED) {
+            p->events = read ? PROCESSOR_EVENT_PIPE_READ : PROCESSOR_EVENT_PIPE_WRITE;
+            p->pipe = pipe;
+            return PROCESSOR_STATE_BLOCKED;
+        }
+        p->r[24] = bytes & 0xff;
+        p->r[25] = bytes >> 8;
     }
 
-    // andi Rd, K | 0111 KKKK dddd KKKK
-    if ((i & 0b1111000000000000) == 0b0111000000000000) {
-        if (p->debug) printf_P(PSTR("andi r%d (0x%02x), 0x%02x\n"), Rdu, p->r[Rdu], K);
-        p->r[Rdu] &= K;
-        processor_flags(p, p->r[Rdu], false, false);
-        return PROCESSOR_STATE_NORMAL;
-    }
+    // pipe_close
+    if (p->pc == 40) {
+        int8_t pipe = p->r[24];
+        if (p->debug) printf_P(PSTR("pipe_close(%d)\n"), pipe);
 
-    // or Rd, Rr | 0010 10rd dddd rrrr
-    if ((i & 0b1111110000000000) == 0b0101000000000000) {
-        if (p->debug) printf_P(PSTR("or r%d (0x%02x), r%d (0x%02x)\n"), Rd, p->r[Rd], Rr, p->r[Rr]);
-        p->r[Rd] |= p->r[Rr];
-        processor_flags(p, p->r[Rd], false, false);
-        return PROCESSOR_STATE_NORMAL;
+        bool closed = false;
+        if (pipe >= 0 && pipe < PIPE_SIZE) {
+            if ((p->pipes_read & (1 << pipe)) != 0) closed = pipe_close(pipe, p, PIPE_OPEN_MODE_READ);
+            if ((p->pipes_write & (1 << pipe)) != 0) closed = pipe_close(pipe, p, PIPE_OPEN_MODE_WRITE);
+            p->pipes_read &= ~(1 << pipe);
+            p->pipes_write &= ~(1 << pipe);
+        }
+        p->r[24] = closed;
     }
 
-    // ori Rd, K | 0110 KKKK dddd KKKK
-    if ((i & 0b1111000000000000) == 0b0110000000000000) {
-        if (p->debug) printf_P(PSTR("ori r%d (0x%02x), 0x%02x\n"), Rdu, p->r[Rdu], K);
-        p->r[Rdu] |= K;
-        processor_flags(p, p->r[Rdu], false, false);
-        return PROCESSOR_STATE_NORMAL;
-    }
+    // The kernel does the work of a vector, the program only pays for the
+    // return instruction
+    p->syscalls[(p->pc >> 1) - 1]++;
+    p->cycles += PROCESSOR_SYSCALL_CYCLES;
+    p->instructions++;
 
-    // eor Rd, Rr | 0010 01rd dddd rrrr
-    if ((i & 0b1111110000000000) == 0b0010010000000000) {
-        if (p->debug) printf_P(PSTR("eor r%d (0x%02x), r%d (0x%02x)\n"), Rd, p->r[Rd], Rr, p->r[Rr]);
-        p->r[Rd] ^= p->r[Rr];
-        processor_flags(p, p->r[Rd], false, false);
-        return PROCESSOR_STATE_NORMAL;
-    }
+    p->pc = processor_read(p, ++p->sp);
+    p->pc |= (processor_read(p, ++p->sp) << 8);
+    return p->events != 0 ? PROCESSOR_STATE_BLOCKED : PROCESSOR_STATE_RETURN;
+}
 
-    // com Rd | 1001 010d dddd 0000
-    if ((i & 0b1111111000001111) == 0b1001010000000000) {
-        if (p->debug) printf_P(PSTR("com r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        processor_sub_with_carry(p, 0xff, p->r[Rd], false, &p->r[Rd], false);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// ###############################################################################
+// ###################### ARITHMETIC AND LOGIC INSTRUCTIONS ######################
+// ###############################################################################
+
+static ProcessorState processor_add_instruction(Processor *p, Instruction *in, bool carry) {
+    if (in->d == in->r) {
+        // lsl Rd | 0000 11dd dddd dddd
+        if (!carry) {
+            if (p->debug) printf_P(PSTR("lsl r%d (0x%02x)\n"), in->d, p->r[in->d]);
+            bool carry = bit(p->r[in->d], 7);
+            p->r[in->d] <<= 1;
+            processor_flags(p, PROCESSOR_FLAGS_HCZNVS, (carry << 8) | p->r[in->d], 0, false);
+            return PROCESSOR_STATE_NORMAL;
+        }
 
-    // neg Rd | 1001 010d dddd 0001
-    if ((i & 0b1111111000001111) == 0b1001010000000001) {
-        if (p->debug) printf_P(PSTR("neg r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        processor_sub_with_half_carry(p, 0, p->r[Rd], false, &p->r[Rd], false);
+        // rol Rd | 0001 11dd dddd dddd
+        if (p->debug) printf_P(PSTR("rol r%d (0x%02x)\n"), in->d, p->r[in->d]);
+        bool old_carry = processor_carry(p);
+        bool carry = bit(p->r[in->d], 7);
+        p->r[in->d] <<= 1;
+        p->r[in->d] |= old_carry;
+        processor_flags(p, PROCESSOR_FLAGS_HCZNVS, (carry << 8) | p->r[in->d], 0, false);
         return PROCESSOR_STATE_NORMAL;
     }
 
-    // inc Rd | 1001 010d dddd 0011
-    if ((i & 0b1111111000001111) == 0b1001010000000011) {
-        if (p->debug) printf_P(PSTR("inc r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        processor_add(p, p->r[Rd], 1, false, &p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+    if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), r%d (0x%02x)\n"), carry ? PSTR("adc") : PSTR("add"), in->d, p->r[in->d], in->r, p->r[in->r]);
+    p->r[in->d] = processor_add(p, p->r[in->d], p->r[in->r], carry ? processor_carry(p) : false, PROCESSOR_FLAGS_HCZNVS);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // dec Rd | 1001 010d dddd 1010
-    if ((i & 0b1111111000001111) == 0b1001010000001010) {
-        if (p->debug) printf_P(PSTR("dec r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        processor_sub(p, p->r[Rd], 1, false, &p->r[Rd], false);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// add Rd, Rr | 0000 11rd dddd rrrr
+static ProcessorState processor_add_handler(Processor *p, Instruction *in) {
+    return processor_add_instruction(p, in, false);
+}
 
-    // ###############################################################################
-    // ############################# BRANCH INSTRUCTIONS #############################
-    // ###############################################################################
+// adc Rd, Rr | 0001 11rd dddd rrrr
+static ProcessorState processor_adc_handler(Processor *p, Instruction *in) {
+    return processor_add_instruction(p, in, true);
+}
 
-    // rjmp k | 1100 kkkk kkkk kkkk
-    if ((i & 0b1111000000000000) == 0b1100000000000000) {
-        if (p->debug) printf_P(PSTR("rjmp %+d\n"), k);
-        if (k == -2) p->running = false;
-        p->pc += k;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// The word instructions store the high byte of their result with the carry
+// out of bit 15, the zero flag also depends on the low byte
+static void processor_word_flags(Processor *p, uint32_t result, uint16_t half) {
+    processor_flags(p, PROCESSOR_FLAGS_CZNVS, (result >> 8) & 0x1ff, half >> 8, false);
+    p->lazy.zero = (result & 0xff) == 0;
+}
 
-    // ijmp | 1001 0100 0000 1001
-    if (i == 0b1001010000001001) {
-        if (p->debug) printf_P(PSTR("ijmp (0x%04x)"), *Z);
-        p->pc = *Z;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// adiw Rd, K | 1001 0110 KKdd KKKK
+static ProcessorState processor_adiw_handler(Processor *p, Instruction *in) {
+    uint16_t *Rd = (uint16_t *)&p->r[in->d];
+    if (p->debug) printf_P(PSTR("adiw r%d (0x%04x), 0x%02x\n"), in->d, *Rd, in->k);
+    uint32_t result = (uint32_t)*Rd + in->k;
+    processor_word_flags(p, result, *Rd ^ in->k);
+    *Rd = result;
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // Instruction: JMP
-    // Encoding: 1001 010k kkkk 110k
-    // Encoding: kkkk kkkk kkkk kkkk
+static ProcessorState processor_sub_instruction(Processor *p, Instruction *in, bool carry) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), r%d (0x%02x)\n"), carry ? PSTR("sbc") : PSTR("sub"), in->d, p->r[in->d], in->r, p->r[in->r]);
+    p->r[in->d] = processor_sub(p, p->r[in->d], p->r[in->r], carry ? processor_carry(p) : false, PROCESSOR_FLAGS_HCZNVS, carry);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // rcall | 1101 kkkk kkkk kkkk
-    if ((i & 0b1111000000000000) == 0b1101000000000000) {
-        if (p->debug) printf_P(PSTR("rcall %+d\n"), k);
-        processor_write(p, p->sp--, p->pc >> 8);
-        processor_write(p, p->sp--, p->pc & 0xff);
-        p->pc += k;
-        return PROCESSOR_STATE_CALL;
-    }
+// sub Rd, Rr | 0001 10rd dddd rrrr
+static ProcessorState processor_sub_handler(Processor *p, Instruction *in) {
+    return processor_sub_instruction(p, in, false);
+}
 
-    // icall | 1001 0101 0000 1001
-    if (i == 0b1001010100001001) {
-        if (p->debug) printf_P(PSTR("icall (0x%04x)"), *Z);
-        processor_write(p, p->sp--, p->pc >> 8);
-        processor_write(p, p->sp--, p->pc & 0xff);
-        p->pc = *Z;
-        return PROCESSOR_STATE_CALL;
-    }
+// sbc Rd, Rr | 0000 10rd dddd rrrr
+static ProcessorState processor_sbc_handler(Processor *p, Instruction *in) {
+    return processor_sub_instruction(p, in, true);
+}
 
-    // Instruction: CALL
-    // Encoding: 1001 010k kkkk 111k
-    // Encoding: kkkk kkkk kkkk kkkk
+static ProcessorState processor_subi_instruction(Processor *p, Instruction *in, bool carry) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), 0x%02x\n"), carry ? PSTR("sbci") : PSTR("subi"), in->d, p->r[in->d], in->k);
+    p->r[in->d] = processor_sub(p, p->r[in->d], in->k, carry ? processor_carry(p) : false, PROCESSOR_FLAGS_HCZNVS, carry);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ret | reti | 1001 0101 000i 1000
-    if ((i & 0b1111111111101111) == 0b1001010100001000) {
-        bool interrupt = bit(i, 4);
-        if (p->debug) printf_P(PSTR("%" PRIpstr "\n"), interrupt ? PSTR("iret") : PSTR("ret"));
-        p->pc = processor_read(p, ++p->sp);
-        p->pc |= (processor_read(p, ++p->sp) << 8);
-        if (interrupt) p->sreg.flags.i = true;
-        return PROCESSOR_STATE_RETURN;
-    }
+// subi Rd, K | 0101 KKKK dddd KKKK
+static ProcessorState processor_subi_handler(Processor *p, Instruction *in) {
+    return processor_subi_instruction(p, in, false);
+}
 
-    // cpse Rd, Rr | 0001 00rd dddd rrrr
-    if ((i & 0b1111110000000000) == 0b0001000000000000) {
-        if (p->debug) printf_P(PSTR("cpse r%d (0x%02x), r%d (0x%02x)\n"), Rd, p->r[Rd], Rr, p->r[Rr]);
-        if (p->r[Rd] == p->r[Rr]) p->pc += 2;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// sbci Rd, K | 0100 KKKK dddd KKKK
+static ProcessorState processor_sbci_handler(Processor *p, Instruction *in) {
+    return processor_subi_instruction(p, in, true);
+}
 
-    // cp Rd, Rr | cpc Rd, Rr | 000c 01rd dddd rrrr
-    if ((i & 0b1110110000000000) == 0b0000010000000000) {
-        bool carry = bit(i, 12) == 0;
-        if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), r%d (0x%02x)\n"), carry ? PSTR("cpc") : PSTR("cp"), Rd, p->r[Rd], Rr, p->r[Rr]);
-        uint8_t c;
-        processor_sub_with_half_carry(p, p->r[Rd], p->r[Rr], carry ? p->sreg.flags.c : false, &c, carry);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// sbiw Rd, K | 1001 0111 KKdd KKKK
+static ProcessorState processor_sbiw_handler(Processor *p, Instruction *in) {
+    uint16_t *Rd = (uint16_t *)&p->r[in->d];
+    if (p->debug) printf_P(PSTR("sbiw r%d (0x%04x), 0x%02x\n"), in->d, *Rd, in->k);
+    uint32_t result = (uint32_t)*Rd - in->k;
+    processor_word_flags(p, result, *Rd ^ in->k);
+    *Rd = result;
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // cpi Rd, K | 0011 KKKK dddd KKKK
-    if ((i & 0b1111000000000000) == 0b0011000000000000) {
-        if (p->debug) printf_P(PSTR("cpi r%d (0x%02x), 0x%02x\n"), Rdu, p->r[Rdu], K);
-        uint8_t c;
-        processor_sub_with_half_carry(p, p->r[Rdu], K, false, &c, false);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// and Rd, Rr | 0010 00rd dddd rrrr
+static ProcessorState processor_and_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("and r%d (0x%02x), r%d (0x%02x)\n"), in->d, p->r[in->d], in->r, p->r[in->r]);
+    p->r[in->d] &= p->r[in->r];
+    processor_flags(p, PROCESSOR_FLAGS_ZNVS, p->r[in->d], p->r[in->d], false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // sbrs Rr, b | sbrc Rr, b | 1111 11sd dddd 0bbb
-    if ((i & 0b1111110000001000) == 0b1111110000000000) {
-        bool set = bit(i, 9) == 0;
-        if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), %d\n"), set ? PSTR("sbrs") : PSTR("sbrc"), Rd, p->r[Rd], b);
-        if (bit(p->r[Rd], b) == set) p->pc += 2;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// andi Rd, K | 0111 KKKK dddd KKKK
+static ProcessorState processor_andi_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("andi r%d (0x%02x), 0x%02x\n"), in->d, p->r[in->d], in->k);
+    p->r[in->d] &= in->k;
+    processor_flags(p, PROCESSOR_FLAGS_ZNVS, p->r[in->d], p->r[in->d], false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // sbis A, b | sbic A, b | 1001 10s1 AAAA Abbb
-    if ((i & 0b1111110100000000) == 0b1001100100000000) {
-        bool set = bit(i, 9) == 0;
-        if (p->debug) printf_P(PSTR("%" PRIpstr " 0x%02x, %d\n"), set ? PSTR("sbis") : PSTR("sbic"), Al, b);
-        if (bit(processor_read(p, 0x20 + Al), b) == set) p->pc += 2;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// or Rd, Rr | 0010 10rd dddd rrrr
+static ProcessorState processor_or_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("or r%d (0x%02x), r%d (0x%02x)\n"), in->d, p->r[in->d], in->r, p->r[in->r]);
+    p->r[in->d] |= p->r[in->r];
+    processor_flags(p, PROCESSOR_FLAGS_ZNVS, p->r[in->d], p->r[in->d], false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // brbs s, k | brbc s, k | 1111 0skk kkkk kbbb
-    if ((i & 0b1111100000000000) == 0b1111000000000000) {
-        bool set = bit(i, 10) == 0;
-        if (p->debug) printf_P(PSTR("%" PRIpstr " %d (%c), %+d\n"), set ? PSTR("brbs") : PSTR("brbc"), b, pgm_read_byte(PSTR("CZNVSHTI") + b), k7);
-        if (bit(p->sreg.data, b) == set) p->pc += k7;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// ori Rd, K | 0110 KKKK dddd KKKK
+static ProcessorState processor_ori_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("ori r%d (0x%02x), 0x%02x\n"), in->d, p->r[in->d], in->k);
+    p->r[in->d] |= in->k;
+    processor_flags(p, PROCESSOR_FLAGS_ZNVS, p->r[in->d], p->r[in->d], false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ###############################################################################
-    // ######################### DATA TRANSFER INSTRUCTIONS ##########################
-    // ###############################################################################
+// eor Rd, Rr | 0010 01rd dddd rrrr
+static ProcessorState processor_eor_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("eor r%d (0x%02x), r%d (0x%02x)\n"), in->d, p->r[in->d], in->r, p->r[in->r]);
+    p->r[in->d] ^= p->r[in->r];
+    processor_flags(p, PROCESSOR_FLAGS_ZNVS, p->r[in->d], p->r[in->d], false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // mov Rd, Rr | 0010 11rd dddd rrrr
-    if ((i & 0b1111110000000000) == 0b0010110000000000) {
-        if (p->debug) printf_P(PSTR("mov r%d, r%d (0x%02x)\n"), Rd, Rr, p->r[Rr]);
-        p->r[Rd] = p->r[Rr];
-        return PROCESSOR_STATE_NORMAL;
-    }
+// com Rd | 1001 010d dddd 0000
+static ProcessorState processor_com_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("com r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    p->r[in->d] = ~p->r[in->d];
+    processor_flags(p, PROCESSOR_FLAGS_CZNVS, (1 << 8) | p->r[in->d], ~p->r[in->d], false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // movw Rd, Rr | 0000 0001 dddd rrrr
-    if ((i & 0b1111111100000000) == 0b0000000100000000) {
-        if (p->debug) printf_P(PSTR("movw r%d, r%d (0x%02x%02x)\n"), Rdw, Rrw, p->r[Rrw + 1], p->r[Rrw]);
-        p->r[Rdw] = p->r[Rrw];
-        p->r[Rdw + 1] = p->r[Rrw + 1];
-        return PROCESSOR_STATE_NORMAL;
-    }
+// neg Rd | 1001 010d dddd 0001
+static ProcessorState processor_neg_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("neg r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    p->r[in->d] = processor_sub(p, 0, p->r[in->d], false, PROCESSOR_FLAGS_HCZNVS, false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ldi Rdu, K | 1110 KKKK dddd KKKK
-    if ((i & 0b1111000000000000) == 0b1110000000000000) {
-        if (p->debug) printf_P(PSTR("ldi r%d, 0x%02x\n"), Rdu, K);
-        p->r[Rdu] = K;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// inc Rd | 1001 010d dddd 0011
+static ProcessorState processor_inc_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("inc r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    p->r[in->d] = processor_add(p, p->r[in->d], 1, false, PROCESSOR_FLAGS_ZNVS);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ld Rd, X | 1001 000d dddd 1100
-    if ((i & 0b1111111000001111) == 0b1001000000001100) {
-        if (p->debug) printf_P(PSTR("ld r%d, X (0x%04x)\n"), Rd, *X);
-        p->r[Rd] = processor_read(p, *X);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// dec Rd | 1001 010d dddd 1010
+static ProcessorState processor_dec_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("dec r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    p->r[in->d] = processor_sub(p, p->r[in->d], 1, false, PROCESSOR_FLAGS_ZNVS, false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ld Rd, X+ | 1001 000d dddd 1101
-    if ((i & 0b1111111000001111) == 0b1001000000001101) {
-        if (p->debug) printf_P(PSTR("ld r%d, X+ (0x%04x)\n"), Rd, *X);
-        p->r[Rd] = processor_read(p, *X);
-        (*X)++;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// The multiply instructions store their product in r1:r0 and only change the
+// carry and zero flags, so the lazy result holds bit 15 of the product as
+// carry and a low byte that is zero when the product is
+static ProcessorState processor_mul_instruction(Processor *p, Instruction *in, const char *name, bool signed_d, bool signed_r, bool fractional) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), r%d (0x%02x)\n"), name, in->d, p->r[in->d], in->r, p->r[in->r]);
+    int16_t a = signed_d ? (int8_t)p->r[in->d] : p->r[in->d];
+    int16_t b = signed_r ? (int8_t)p->r[in->r] : p->r[in->r];
+    uint16_t result = (int32_t)a * b;
+    bool carry = bit(result, 15);
+    if (fractional) result <<= 1;
+    p->r[0] = result & 0xff;
+    p->r[1] = result >> 8;
+    processor_flags(p, PROCESSOR_FLAGS_CZ, (carry << 8) | (result != 0), 0, false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ld Rd, -X | 1001 000d dddd 1110
-    if ((i & 0b1111111000001111) == 0b1001000000001110) {
-        (*X)--;
-        if (p->debug) printf_P(PSTR("ld r%d, -X (0x%04x)\n"), Rd, *X);
-        p->r[Rd] = processor_read(p, *X);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// mul Rd, Rr | 1001 11rd dddd rrrr
+static ProcessorState processor_mul_handler(Processor *p, Instruction *in) {
+    return processor_mul_instruction(p, in, PSTR("mul"), false, false, false);
+}
 
-    // ld Rd, Y | 1000 000d dddd 1000
-    if ((i & 0b1111111000001111) == 0b1000000000001000) {
-        if (p->debug) printf_P(PSTR("ld r%d, Y (0x%04x)\n"), Rd, *Y);
-        p->r[Rd] = processor_read(p, *Y);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// muls Rdu, Rru | 0000 0010 dddd rrrr
+static ProcessorState processor_muls_handler(Processor *p, Instruction *in) {
+    return processor_mul_instruction(p, in, PSTR("muls"), true, true, false);
+}
 
-    // ld Rd, Y+ | 1001 000d dddd 1001
-    if ((i & 0b1111111000001111) == 0b1001000000001001) {
-        if (p->debug) printf_P(PSTR("ld r%d, Y+ (0x%04x)\n"), Rd, *Y);
-        p->r[Rd] = processor_read(p, *Y);
-        (*Y)++;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// mulsu Rdl, Rrl | 0000 0011 0ddd 0rrr
+static ProcessorState processor_mulsu_handler(Processor *p, Instruction *in) {
+    return processor_mul_instruction(p, in, PSTR("mulsu"), true, false, false);
+}
 
-    // ld Rd, -Y | 1001 000d dddd 1010
-    if ((i & 0b1111111000001111) == 0b1001000000001010) {
-        (*Y)--;
-        if (p->debug) printf_P(PSTR("ld r%d, -Y (0x%04x)\n"), Rd, *Y);
-        p->r[Rd] = processor_read(p, *Y);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// fmul Rdl, Rrl | 0000 0011 0ddd 1rrr
+static ProcessorState processor_fmul_handler(Processor *p, Instruction *in) {
+    return processor_mul_instruction(p, in, PSTR("fmul"), false, false, true);
+}
 
-    // // Instruction: LDD Rd, Y + q
-    // // Encoding: 10q0 qq0d dddd 1qqq
-    // if ((instruction & 0b1101001000001000) == 0b1000000000001000) {
-    //     uint8_t Rd = (instruction >> 4) & 0b11111;
-    //     uint8_t q = (bit(instruction, 13) << 5) | (bit(instruction, 11) << 4) | (bit(instruction, 10) << 3) | (instruction & 0b111);
-    //     #ifdef DEBUG
-    //         printf("Execute: ldD Rd, Y + q");
-    //     #endif
-    //     uint16_t Y = processor->registers[28] | (processor->registers[29] << 8);
-    //     processor->registers[Rd] = processor_memory_read(processor, Y + q);
-    //     return;
-    // }
-
-    // ld Rd, Z | 1000 000d dddd 0000
-    if ((i & 0b1111111000001111) == 0b1000000000000000) {
-        if (p->debug) printf_P(PSTR("ld r%d, Z (0x%04x)\n"), Rd, *Z);
-        p->r[Rd] = processor_read(p, *Z);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// fmuls Rdl, Rrl | 0000 0011 1ddd 0rrr
+static ProcessorState processor_fmuls_handler(Processor *p, Instruction *in) {
+    return processor_mul_instruction(p, in, PSTR("fmuls"), true, true, true);
+}
 
-    // ld Rd, Z+ | 1001 000d dddd 0001
-    if ((i & 0b1111111000001111) == 0b1001000000000001) {
-        if (p->debug) printf_P(PSTR("ld r%d, Z+ (0x%04x)\n"), Rd, *Z);
-        p->r[Rd] = processor_read(p, *Z);
-        (*Z)++;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// fmulsu Rdl, Rrl | 0000 0011 1ddd 1rrr
+static ProcessorState processor_fmulsu_handler(Processor *p, Instruction *in) {
+    return processor_mul_instruction(p, in, PSTR("fmulsu"), true, false, true);
+}
 
-    // ld Rd, -Z | 1001 000d dddd 0010
-    if ((i & 0b1111111000001111) == 0b1001000000000010) {
-        (*Z)--;
-        if (p->debug) printf_P(PSTR("ld r%d, -Z (0x%04x)\n"), Rd, *Z);
-        p->r[Rd] = processor_read(p, *Z);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// ###############################################################################
+// ############################# BRANCH INSTRUCTIONS #############################
+// ###############################################################################
 
-    // // Instruction: LDD Rd, Z + q
-    // // Encoding: 10q0 qq0d dddd 0qqq
-    // if ((instruction & 0b1101001000001000) == 0b1000000000000000) {
-    //     uint8_t Rd = (instruction >> 4) & 0b11111;
-    //     uint8_t q = (bit(instruction, 13) << 5) | (bit(instruction, 11) << 4) | (bit(instruction, 10) << 3) | (instruction & 0b111);
-    //     #ifdef DEBUG
-    //         printf("Execute: ldD Rd, Z + q");
-    //     #endif
-    //     uint16_t Z = processor->registers[30] | (processor->registers[31] << 8);
-    //     processor->registers[Rd] = processor_memory_read(processor, Z + q);
-    //     return;
-    // }
-
-    // Instruction: LDS Rd, k
-    // Encoding: 1001 000d dddd 0000
-    // Encoding: kkkk kkkk kkkk kkkk
-
-    // st X, Rd | 1001 001d dddd 1100
-    if ((i & 0b1111111000001111) == 0b1001001000001100) {
-        if (p->debug) printf_P(PSTR("st X (0x%04x), r%d (0x%02x)\n"), *X, Rd, p->r[Rd]);
-        processor_write(p, *X, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// rjmp k | 1100 kkkk kkkk kkkk
+static ProcessorState processor_rjmp_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("rjmp %+d\n"), in->k);
+    if (in->k == -2) p->running = false;
+    p->pc += in->k;
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // st X+, Rd | 1001 001d dddd 1101
-    if ((i & 0b1111111000001111) == 0b1001001000001101) {
-        if (p->debug) printf_P(PSTR("st X+ (0x%04x), r%d (0x%02x)\n"), *X, Rd, p->r[Rd]);
-        processor_write(p, *X, p->r[Rd]);
-        (*X)++;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// ijmp | 1001 0100 0000 1001
+static ProcessorState processor_ijmp_handler(Processor *p, Instruction *in) {
+    (void)in;
+    uint16_t *Z = (uint16_t *)&p->r[30];
+    if (p->debug) printf_P(PSTR("ijmp (0x%04x)"), *Z);
+    p->pc = (uint16_t)(*Z << 1);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // st -X, Rd | 1001 001d dddd 1110
-    if ((i & 0b1111111000001111) == 0b1001001000001110) {
-        (*X)--;
-        if (p->debug) printf_P(PSTR("st -X (0x%04x), r%d (0x%02x)\n"), *X, Rd, p->r[Rd]);
-        processor_write(p, *X, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// jmp k | 1001 010k kkkk 110k kkkk kkkk kkkk kkkk
+static ProcessorState processor_jmp_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("jmp 0x%04x\n"), (uint16_t)in->k << 1);
+    p->pc = (uint16_t)in->k << 1;
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // st Y, Rd | 1000 001d dddd 1000
-    if ((i & 0b1111111000001111) == 0b1000001000001000) {
-        if (p->debug) printf_P(PSTR("st Y (0x%04x), r%d (0x%02x)\n"), *Y, Rd, p->r[Rd]);
-        processor_write(p, *Y, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// rcall | 1101 kkkk kkkk kkkk
+static ProcessorState processor_rcall_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("rcall %+d\n"), in->k);
+    processor_push(p, p->pc >> 8);
+    processor_push(p, p->pc & 0xff);
+    p->pc += in->k;
+    return PROCESSOR_STATE_CALL;
+}
 
-    // st Y+, Rd | 1001 001d dddd 1001
-    if ((i & 0b1111111000001111) == 0b1001001000001001) {
-        if (p->debug) printf_P(PSTR("st Y+ (0x%04x), r%d (0x%02x)\n"), *Y, Rd, p->r[Rd]);
-        processor_write(p, *Y, p->r[Rd]);
-        (*Y)++;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// icall | 1001 0101 0000 1001
+static ProcessorState processor_icall_handler(Processor *p, Instruction *in) {
+    (void)in;
+    uint16_t *Z = (uint16_t *)&p->r[30];
+    if (p->debug) printf_P(PSTR("icall (0x%04x)"), *Z);
+    processor_push(p, p->pc >> 8);
+    processor_push(p, p->pc & 0xff);
+    p->pc = (uint16_t)(*Z << 1);
+    return PROCESSOR_STATE_CALL;
+}
 
-    // st -Y, Rd | 1001 001d dddd 1010
-    if ((i & 0b1111111000001111) == 0b1001001000001010) {
-        (*Y)--;
-        if (p->debug) printf_P(PSTR("st -Y (0x%04x), r%d (0x%02x)\n"), *Y, Rd, p->r[Rd]);
-        processor_write(p, *Y, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// call k | 1001 010k kkkk 111k kkkk kkkk kkkk kkkk
+static ProcessorState processor_call_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("call 0x%04x\n"), (uint16_t)in->k << 1);
+    p->pc += 2;
+    processor_push(p, p->pc >> 8);
+    processor_push(p, p->pc & 0xff);
+    p->pc = (uint16_t)in->k << 1;
+    return PROCESSOR_STATE_CALL;
+}
 
-    // // Instruction: STD Y + q, Rr
-    // // Encoding: 10q0 qq1r rrrr 1qqq
-    // if ((instruction & 0b1101001000001000) == 0b1000001000001000) {
-    //     uint8_t Rr = (instruction >> 4) & 0b11111;
-    //     uint8_t q = (bit(instruction, 13) << 5) | (bit(instruction, 11) << 4) | (bit(instruction, 10) << 3) | (instruction & 0b111);
-    //     #ifdef DEBUG
-    //         printf("Execute: stD Y + 0x%02x, r%d\n", q, Rr);
-    //     #endif
-    //     uint16_t Y = processor->registers[28] | (processor->registers[29] << 8);
-    //     processor_memory_write(processor, Y + q, processor->registers[Rr]);
-    //     return;
-    // }
-
-    // st Z, Rd | 1000 001d dddd 0000
-    if ((i & 0b1111111000001111) == 0b1000001000000000) {
-        if (p->debug) printf_P(PSTR("st Z (0x%04x), r%d (0x%02x)\n"), *Z, Rd, p->r[Rd]);
-        processor_write(p, *Z, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+static ProcessorState processor_ret_instruction(Processor *p, bool interrupt) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr "\n"), interrupt ? PSTR("iret") : PSTR("ret"));
+    p->pc = processor_read(p, ++p->sp);
+    p->pc |= (processor_read(p, ++p->sp) << 8);
+    if (interrupt) p->sreg.flags.i = true;
+    return PROCESSOR_STATE_RETURN;
+}
 
-    // st Z+, Rd | 1001 001d dddd 0001
-    if ((i & 0b1111111000001111) == 0b1001001000000001) {
-        if (p->debug) printf_P(PSTR("st Z+ (0x%04x), r%d (0x%02x)\n"), *Z, Rd, p->r[Rd]);
-        processor_write(p, *Z, p->r[Rd]);
-        (*Z)++;
-        return PROCESSOR_STATE_NORMAL;
-    }
+// ret | 1001 0101 0000 1000
+static ProcessorState processor_ret_handler(Processor *p, Instruction *in) {
+    (void)in;
+    return processor_ret_instruction(p, false);
+}
 
-    // st -Z, Rd | 1001 001d dddd 0010
-    if ((i & 0b1111111000001111) == 0b1001001000000010) {
-        (*Z)--;
-        if (p->debug) printf_P(PSTR("st -Z (0x%04x), r%d (0x%02x)\n"), *Z, Rd, p->r[Rd]);
-        processor_write(p, *Z, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// reti | 1001 0101 0001 1000
+static ProcessorState processor_reti_handler(Processor *p, Instruction *in) {
+    (void)in;
+    return processor_ret_instruction(p, true);
+}
 
-    // // Instruction: STD Z + q, Rr
-    // // Encoding: 10q0 qq1r rrrr 0qqq
-    // if ((instruction & 0b1101001000001000) == 0b1000001000000000) {
-    //     uint8_t Rr = (instruction >> 4) & 0b11111;
-    //     uint8_t q = (bit(instruction, 13) << 5) | (bit(instruction, 11) << 4) | (bit(instruction, 10) << 3) | (instruction & 0b111);
-    //     #ifdef DEBUG
-    //         printf("Execute: stD Z + 0x%02x, r%d\n", q, Rr);
-    //     #endif
-    //     uint16_t Z = processor->registers[28] | (processor->registers[29] << 8);
-    //     processor_memory_write(processor, Z + q, processor->registers[Rr]);
-    //     return;
-    // }
-
-    // Instruction: STS k, Rr
-    // Encoding: 1001 001d dddd 0000
-    // Encoding: kkkk kkkk kkkk kkkk
-
-    // lpm r0, Z | 1001 0101 1100 1000
-    if (i == 0b1001010111001000) {
-        if (p->debug) printf_P(PSTR("lpm Z (0x%04x)\n"), *Z);
-        p->r[0] = eeprom_read_byte(p->pgm_address + *Z);
-        return PROCESSOR_STATE_NORMAL;
+// A skip instruction skips both words of the two word lds, sts, jmp and call
+// instructions and takes an extra cycle for every skipped word
+static void processor_skip(Processor *p) {
+    uint16_t i = eeprom_read_word(p->pgm_address + p->pc);
+    if ((i & 0b1111110000001111) == 0b1001000000000000 || (i & 0b1111111000001100) == 0b1001010000001100) {
+        p->pc += 4;
+        p->cycles += 2;
+    } else {
+        p->pc += 2;
+        p->cycles++;
     }
+}
 
-    // lpm Rd, Z | 1001 000d dddd 0100
-    if ((i & 0b1111111000001111) == 0b1001000000000100) {
-        if (p->debug) printf_P(PSTR("lpm r%d, Z (0x%04x)\n"), Rd, *Z);
-        p->r[Rd] = eeprom_read_byte(p->pgm_address + *Z);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// cpse Rd, Rr | 0001 00rd dddd rrrr
+static ProcessorState processor_cpse_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("cpse r%d (0x%02x), r%d (0x%02x)\n"), in->d, p->r[in->d], in->r, p->r[in->r]);
+    if (p->r[in->d] == p->r[in->r]) processor_skip(p);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // lpm Rd, Z+ | 1001 000d dddd 0101
-    if ((i & 0b1111111000001111) == 0b1001000000000101) {
-        if (p->debug) printf_P(PSTR("lpm r%d, Z+ (0x%04x)\n"), Rd, *Z);
-        p->r[Rd] = eeprom_read_byte(p->pgm_address + *Z);
-        (*Z)++;
-        return PROCESSOR_STATE_NORMAL;
-    }
+static ProcessorState processor_cp_instruction(Processor *p, Instruction *in, bool carry) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), r%d (0x%02x)\n"), carry ? PSTR("cpc") : PSTR("cp"), in->d, p->r[in->d], in->r, p->r[in->r]);
+    processor_sub(p, p->r[in->d], p->r[in->r], carry ? processor_carry(p) : false, PROCESSOR_FLAGS_HCZNVS, carry);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // in Rd, A | 1011 0AAd dddd AAAA
-    if ((i & 0b1111100000000000) == 0b1011000000000000) {
-        if (p->debug) printf_P(PSTR("in r%d, 0x%02x\n"), Rd, A);
-        p->r[Rd] = processor_read(p, 0x20 + A);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// cp Rd, Rr | 0001 01rd dddd rrrr
+static ProcessorState processor_cp_handler(Processor *p, Instruction *in) {
+    return processor_cp_instruction(p, in, false);
+}
 
-    // out A, Rr | 1011 1AAd dddd AAAA
-    if ((i & 0b1111100000000000) == 0b1011100000000000) {
-        if (p->debug) printf_P(PSTR("out 0x%02x, r%d (0x%02x)\n"), A, Rd, p->r[Rd]);
-        processor_write(p, 0x20 + A, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// cpc Rd, Rr | 0000 01rd dddd rrrr
+static ProcessorState processor_cpc_handler(Processor *p, Instruction *in) {
+    return processor_cp_instruction(p, in, true);
+}
 
-    // push Rd | 1001 001d dddd 1111
-    if ((i & 0b1111111000001111) == 0b1001001000001111) {
-        if (p->debug) printf_P(PSTR("push r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        processor_write(p, p->sp--, p->r[Rd]);
-        return PROCESSOR_STATE_NORMAL;
-    }
+// cpi Rd, K | 0011 KKKK dddd KKKK
+static ProcessorState processor_cpi_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("cpi r%d (0x%02x), 0x%02x\n"), in->d, p->r[in->d], in->k);
+    processor_sub(p, p->r[in->d], in->k, false, PROCESSOR_FLAGS_HCZNVS, false);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // pop Rd | 1001 000d dddd 1111
-    if ((i & 0b1111111000001111) == 0b1001000000001111) {
-        if (p->debug) printf_P(PSTR("pop r%d\n"), Rd);
-        p->r[Rd] = processor_read(p, ++p->sp);
-        return PROCESSOR_STATE_NORMAL;
+static ProcessorState processor_sbr_instruction(Processor *p, Instruction *in, bool set) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " r%d (0x%02x), %d\n"), set ? PSTR("sbrs") : PSTR("sbrc"), in->d, p->r[in->d], in->r);
+    if (bit(p->r[in->d], in->r) == set) processor_skip(p);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// sbrc Rr, b | 1111 110d dddd 0bbb
+static ProcessorState processor_sbrc_handler(Processor *p, Instruction *in) {
+    return processor_sbr_instruction(p, in, false);
+}
+
+// sbrs Rr, b | 1111 111d dddd 0bbb
+static ProcessorState processor_sbrs_handler(Processor *p, Instruction *in) {
+    return processor_sbr_instruction(p, in, true);
+}
+
+static ProcessorState processor_sbi_instruction(Processor *p, Instruction *in, bool set) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " 0x%02x, %d\n"), set ? PSTR("sbis") : PSTR("sbic"), in->k, in->r);
+    if (bit(processor_read(p, 0x20 + in->k), in->r) == set) processor_skip(p);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// sbic A, b | 1001 1001 AAAA Abbb
+static ProcessorState processor_sbic_handler(Processor *p, Instruction *in) {
+    return processor_sbi_instruction(p, in, false);
+}
+
+// sbis A, b | 1001 1011 AAAA Abbb
+static ProcessorState processor_sbis_handler(Processor *p, Instruction *in) {
+    return processor_sbi_instruction(p, in, true);
+}
+
+static ProcessorState processor_br_instruction(Processor *p, Instruction *in, bool set) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " %d (%c), %+d\n"), set ? PSTR("brbs") : PSTR("brbc"), in->r, pgm_read_byte(PSTR("CZNVSHTI") + in->r), in->k);
+    if (processor_flag(p, in->r) == set) {
+        p->pc += in->k;
+        p->cycles++;
     }
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ###############################################################################
-    // ####################### BIT AND BIT-TEST INSTRUCTIONS #########################
-    // ###############################################################################
+// brbs s, k | 1111 00kk kkkk kbbb
+static ProcessorState processor_brbs_handler(Processor *p, Instruction *in) {
+    return processor_br_instruction(p, in, true);
+}
 
-    // sbi A, b | cbi A, b | 1001 10s0 AAAA Abbb
-    if ((i & 0b1111110100000000) == 0b1001100000000000) {
-        uint8_t set = bit(i, 9);
-        if (p->debug) printf_P(PSTR("%" PRIpstr " 0x%02x, %d\n"), set ? PSTR("sbi") : PSTR("cbi"), Al, b);
-        uint8_t data = processor_read(p, 0x20 + Al);
-        if (set) {
-            bit_set(data, b);
-        } else {
-            bit_clear(data, b);
-        }
-        processor_write(p, 0x20 + Al, data);
-        return PROCESSOR_STATE_NORMAL;
+// brbc s, k | 1111 01kk kkkk kbbb
+static ProcessorState processor_brbc_handler(Processor *p, Instruction *in) {
+    return processor_br_instruction(p, in, false);
+}
+
+// ###############################################################################
+// ######################### DATA TRANSFER INSTRUCTIONS ##########################
+// ###############################################################################
+
+// mov Rd, Rr | 0010 11rd dddd rrrr
+static ProcessorState processor_mov_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("mov r%d, r%d (0x%02x)\n"), in->d, in->r, p->r[in->r]);
+    p->r[in->d] = p->r[in->r];
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// movw Rd, Rr | 0000 0001 dddd rrrr
+static ProcessorState processor_movw_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("movw r%d, r%d (0x%02x%02x)\n"), in->d, in->r, p->r[in->r + 1], p->r[in->r]);
+    p->r[in->d] = p->r[in->r];
+    p->r[in->d + 1] = p->r[in->r + 1];
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// ldi Rdu, K | 1110 KKKK dddd KKKK
+static ProcessorState processor_ldi_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("ldi r%d, 0x%02x\n"), in->d, in->k);
+    p->r[in->d] = in->k;
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// The pointer registers X (r26), Y (r28) and Z (r30) are encoded in the
+// handler table by their register number, the mode selects the post increment
+// or pre decrement variant of the ld and st instructions
+#define PROCESSOR_POINTER_MODE_NONE 0
+#define PROCESSOR_POINTER_MODE_INCREMENT 1
+#define PROCESSOR_POINTER_MODE_DECREMENT 2
+
+static ProcessorState processor_ld_instruction(Processor *p, Instruction *in, uint8_t pointer, uint8_t mode) {
+    uint16_t *P = (uint16_t *)&p->r[pointer];
+    if (mode == PROCESSOR_POINTER_MODE_DECREMENT) (*P)--;
+    if (p->debug) printf_P(PSTR("ld r%d, %" PRIpstr "%c%" PRIpstr " (0x%04x)\n"), in->d,
+        mode == PROCESSOR_POINTER_MODE_DECREMENT ? PSTR("-") : PSTR(""), 'X' + ((pointer - 26) >> 1),
+        mode == PROCESSOR_POINTER_MODE_INCREMENT ? PSTR("+") : PSTR(""), *P);
+    p->r[in->d] = processor_read(p, *P);
+    if (mode == PROCESSOR_POINTER_MODE_INCREMENT) (*P)++;
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// ld Rd, X | 1001 000d dddd 1100
+static ProcessorState processor_ld_x_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 26, PROCESSOR_POINTER_MODE_NONE);
+}
+
+// ld Rd, X+ | 1001 000d dddd 1101
+static ProcessorState processor_ld_x_increment_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 26, PROCESSOR_POINTER_MODE_INCREMENT);
+}
+
+// ld Rd, -X | 1001 000d dddd 1110
+static ProcessorState processor_ld_x_decrement_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 26, PROCESSOR_POINTER_MODE_DECREMENT);
+}
+
+// ld Rd, Y | 1000 000d dddd 1000
+static ProcessorState processor_ld_y_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 28, PROCESSOR_POINTER_MODE_NONE);
+}
+
+// ld Rd, Y+ | 1001 000d dddd 1001
+static ProcessorState processor_ld_y_increment_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 28, PROCESSOR_POINTER_MODE_INCREMENT);
+}
+
+// ld Rd, -Y | 1001 000d dddd 1010
+static ProcessorState processor_ld_y_decrement_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 28, PROCESSOR_POINTER_MODE_DECREMENT);
+}
+
+static ProcessorState processor_ldd_instruction(Processor *p, Instruction *in, uint8_t pointer) {
+    uint16_t *P = (uint16_t *)&p->r[pointer];
+    if (p->debug) printf_P(PSTR("ldd r%d, %c+%d (0x%04x)\n"), in->d, 'X' + ((pointer - 26) >> 1), in->k, *P + in->k);
+    p->r[in->d] = processor_read(p, *P + in->k);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// ldd Rd, Y+q | 10q0 qq0d dddd 1qqq
+static ProcessorState processor_ldd_y_handler(Processor *p, Instruction *in) {
+    return processor_ldd_instruction(p, in, 28);
+}
+
+// ld Rd, Z | 1000 000d dddd 0000
+static ProcessorState processor_ld_z_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 30, PROCESSOR_POINTER_MODE_NONE);
+}
+
+// ld Rd, Z+ | 1001 000d dddd 0001
+static ProcessorState processor_ld_z_increment_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 30, PROCESSOR_POINTER_MODE_INCREMENT);
+}
+
+// ld Rd, -Z | 1001 000d dddd 0010
+static ProcessorState processor_ld_z_decrement_handler(Processor *p, Instruction *in) {
+    return processor_ld_instruction(p, in, 30, PROCESSOR_POINTER_MODE_DECREMENT);
+}
+
+// ldd Rd, Z+q | 10q0 qq0d dddd 0qqq
+static ProcessorState processor_ldd_z_handler(Processor *p, Instruction *in) {
+    return processor_ldd_instruction(p, in, 30);
+}
+
+// lds Rd, k | 1001 000d dddd 0000 kkkk kkkk kkkk kkkk
+static ProcessorState processor_lds_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("lds r%d, 0x%04x\n"), in->d, (uint16_t)in->k);
+    p->pc += 2;
+    p->r[in->d] = processor_read(p, in->k);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+static ProcessorState processor_st_instruction(Processor *p, Instruction *in, uint8_t pointer, uint8_t mode) {
+    uint16_t *P = (uint16_t *)&p->r[pointer];
+    if (mode == PROCESSOR_POINTER_MODE_DECREMENT) (*P)--;
+    if (p->debug) printf_P(PSTR("st %" PRIpstr "%c%" PRIpstr " (0x%04x), r%d (0x%02x)\n"),
+        mode == PROCESSOR_POINTER_MODE_DECREMENT ? PSTR("-") : PSTR(""), 'X' + ((pointer - 26) >> 1),
+        mode == PROCESSOR_POINTER_MODE_INCREMENT ? PSTR("+") : PSTR(""), *P, in->d, p->r[in->d]);
+    processor_write(p, *P, p->r[in->d]);
+    if (mode == PROCESSOR_POINTER_MODE_INCREMENT) (*P)++;
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// st X, Rd | 1001 001d dddd 1100
+static ProcessorState processor_st_x_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 26, PROCESSOR_POINTER_MODE_NONE);
+}
+
+// st X+, Rd | 1001 001d dddd 1101
+static ProcessorState processor_st_x_increment_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 26, PROCESSOR_POINTER_MODE_INCREMENT);
+}
+
+// st -X, Rd | 1001 001d dddd 1110
+static ProcessorState processor_st_x_decrement_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 26, PROCESSOR_POINTER_MODE_DECREMENT);
+}
+
+// st Y, Rd | 1000 001d dddd 1000
+static ProcessorState processor_st_y_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 28, PROCESSOR_POINTER_MODE_NONE);
+}
+
+// st Y+, Rd | 1001 001d dddd 1001
+static ProcessorState processor_st_y_increment_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 28, PROCESSOR_POINTER_MODE_INCREMENT);
+}
+
+// st -Y, Rd | 1001 001d dddd 1010
+static ProcessorState processor_st_y_decrement_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 28, PROCESSOR_POINTER_MODE_DECREMENT);
+}
+
+static ProcessorState processor_std_instruction(Processor *p, Instruction *in, uint8_t pointer) {
+    uint16_t *P = (uint16_t *)&p->r[pointer];
+    if (p->debug) printf_P(PSTR("std %c+%d (0x%04x), r%d (0x%02x)\n"), 'X' + ((pointer - 26) >> 1), in->k, *P + in->k, in->d, p->r[in->d]);
+    processor_write(p, *P + in->k, p->r[in->d]);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// std Y+q, Rd | 10q0 qq1d dddd 1qqq
+static ProcessorState processor_std_y_handler(Processor *p, Instruction *in) {
+    return processor_std_instruction(p, in, 28);
+}
+
+// st Z, Rd | 1000 001d dddd 0000
+static ProcessorState processor_st_z_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 30, PROCESSOR_POINTER_MODE_NONE);
+}
+
+// st Z+, Rd | 1001 001d dddd 0001
+static ProcessorState processor_st_z_increment_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 30, PROCESSOR_POINTER_MODE_INCREMENT);
+}
+
+// st -Z, Rd | 1001 001d dddd 0010
+static ProcessorState processor_st_z_decrement_handler(Processor *p, Instruction *in) {
+    return processor_st_instruction(p, in, 30, PROCESSOR_POINTER_MODE_DECREMENT);
+}
+
+// std Z+q, Rd | 10q0 qq1d dddd 0qqq
+static ProcessorState processor_std_z_handler(Processor *p, Instruction *in) {
+    return processor_std_instruction(p, in, 30);
+}
+
+// sts k, Rd | 1001 001d dddd 0000 kkkk kkkk kkkk kkkk
+static ProcessorState processor_sts_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("sts 0x%04x, r%d (0x%02x)\n"), (uint16_t)in->k, in->d, p->r[in->d]);
+    p->pc += 2;
+    processor_write(p, in->k, p->r[in->d]);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// lpm r0, Z | 1001 0101 1100 1000
+static ProcessorState processor_lpm_r0_handler(Processor *p, Instruction *in) {
+    (void)in;
+    uint16_t *Z = (uint16_t *)&p->r[30];
+    if (p->debug) printf_P(PSTR("lpm Z (0x%04x)\n"), *Z);
+    p->r[0] = eeprom_read_byte(p->pgm_address + *Z);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// lpm Rd, Z | 1001 000d dddd 0100
+static ProcessorState processor_lpm_handler(Processor *p, Instruction *in) {
+    uint16_t *Z = (uint16_t *)&p->r[30];
+    if (p->debug) printf_P(PSTR("lpm r%d, Z (0x%04x)\n"), in->d, *Z);
+    p->r[in->d] = eeprom_read_byte(p->pgm_address + *Z);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// lpm Rd, Z+ | 1001 000d dddd 0101
+static ProcessorState processor_lpm_increment_handler(Processor *p, Instruction *in) {
+    uint16_t *Z = (uint16_t *)&p->r[30];
+    if (p->debug) printf_P(PSTR("lpm r%d, Z+ (0x%04x)\n"), in->d, *Z);
+    p->r[in->d] = eeprom_read_byte(p->pgm_address + *Z);
+    (*Z)++;
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// in Rd, A | 1011 0AAd dddd AAAA
+static ProcessorState processor_in_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("in r%d, 0x%02x\n"), in->d, in->k);
+    p->r[in->d] = processor_read(p, 0x20 + in->k);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// out A, Rr | 1011 1AAd dddd AAAA
+static ProcessorState processor_out_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("out 0x%02x, r%d (0x%02x)\n"), in->k, in->d, p->r[in->d]);
+    processor_write(p, 0x20 + in->k, p->r[in->d]);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// push Rd | 1001 001d dddd 1111
+static ProcessorState processor_push_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("push r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    processor_push(p, p->r[in->d]);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// pop Rd | 1001 000d dddd 1111
+static ProcessorState processor_pop_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("pop r%d\n"), in->d);
+    p->r[in->d] = processor_read(p, ++p->sp);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// ###############################################################################
+// ####################### BIT AND BIT-TEST INSTRUCTIONS #########################
+// ###############################################################################
+
+static ProcessorState processor_sbi_cbi_instruction(Processor *p, Instruction *in, bool set) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " 0x%02x, %d\n"), set ? PSTR("sbi") : PSTR("cbi"), in->k, in->r);
+    uint8_t data = processor_read(p, 0x20 + in->k);
+    if (set) {
+        bit_set(data, in->r);
+    } else {
+        bit_clear(data, in->r);
     }
+    processor_write(p, 0x20 + in->k, data);
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // lsr Rd | 1001 010d dddd 0110
-    if ((i & 0b1111111000001111) == 0b1001010000000110) {
-        if (p->debug) printf_P(PSTR("lsr r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        p->sreg.flags.c = bit(p->r[Rd], 0);
-        p->r[Rd] >>= 1;
+// cbi A, b | 1001 1000 AAAA Abbb
+static ProcessorState processor_cbi_handler(Processor *p, Instruction *in) {
+    return processor_sbi_cbi_instruction(p, in, false);
+}
 
-        p->sreg.flags.n = bit(p->r[Rd], 7);
-        processor_flags(p, p->r[Rd], false, p->sreg.flags.n != p->sreg.flags.c);
-        return PROCESSOR_STATE_NORMAL;
+// sbi A, b | 1001 1010 AAAA Abbb
+static ProcessorState processor_sbi_handler(Processor *p, Instruction *in) {
+    return processor_sbi_cbi_instruction(p, in, true);
+}
+
+// lsr Rd | 1001 010d dddd 0110
+static ProcessorState processor_lsr_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("lsr r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    bool carry = bit(p->r[in->d], 0);
+    p->r[in->d] >>= 1;
+    processor_flags(p, PROCESSOR_FLAGS_CZNVS, (carry << 8) | p->r[in->d], 0, false);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// ror Rd | 1001 010d dddd 0111
+static ProcessorState processor_ror_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("ror r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    bool old_carry = processor_carry(p);
+    bool carry = bit(p->r[in->d], 0);
+    p->r[in->d] >>= 1;
+    p->r[in->d] |= old_carry << 7;
+    processor_flags(p, PROCESSOR_FLAGS_CZNVS, (carry << 8) | p->r[in->d], 0, false);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// asr Rd | 1001 010d dddd 0101
+static ProcessorState processor_asr_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("asr r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    bool old_top_bit = bit(p->r[in->d], 7);
+    bool carry = bit(p->r[in->d], 0);
+    p->r[in->d] >>= 1;
+    if (old_top_bit) p->r[in->d] |= 1 << 7;
+    processor_flags(p, PROCESSOR_FLAGS_CZNVS, (carry << 8) | p->r[in->d], 0, false);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// swap Rd | 1001 010d dddd 0010
+static ProcessorState processor_swap_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("Execute: swap r%d (0x%02x)\n"), in->d, p->r[in->d]);
+    p->r[in->d] = ((p->r[in->d] & 0b1111) << 4) | (p->r[in->d] >> 4);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+static ProcessorState processor_bset_bclr_instruction(Processor *p, Instruction *in, bool set) {
+    if (p->debug) printf_P(PSTR("%" PRIpstr " %d\n"), set ? PSTR("bset") : PSTR("bclr"), in->r);
+    bit_clear(p->lazy.pending, in->r);
+    if (set) {
+        bit_set(p->sreg.data, in->r);
+    } else {
+        bit_clear(p->sreg.data, in->r);
     }
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // ror Rd | 1001 010d dddd 0111
-    if ((i & 0b1111111000001111) == 0b1001010000000111) {
-        if (p->debug) printf_P(PSTR("ror r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        bool old_carry = p->sreg.flags.c;
-        p->sreg.flags.c = bit(p->r[Rd], 0);
-        p->r[Rd] >>= 1;
-        p->r[Rd] |= old_carry << 7;
+// bset s | 1001 0100 0sss 1000
+static ProcessorState processor_bset_handler(Processor *p, Instruction *in) {
+    return processor_bset_bclr_instruction(p, in, true);
+}
 
-        p->sreg.flags.n = bit(p->r[Rd], 7);
-        processor_flags(p, p->r[Rd], false, p->sreg.flags.n != p->sreg.flags.c);
-        return PROCESSOR_STATE_NORMAL;
+// bclr s | 1001 0100 1sss 1000
+static ProcessorState processor_bclr_handler(Processor *p, Instruction *in) {
+    return processor_bset_bclr_instruction(p, in, false);
+}
+
+// bst Rd, b | 1111 101d dddd 0bbb
+static ProcessorState processor_bst_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("bst r%d, %d\n"), in->d, in->r);
+    p->sreg.flags.t = bit(p->r[in->d], in->r);
+    return PROCESSOR_STATE_NORMAL;
+}
+
+// bld Rd, b | 1111 100d dddd 0bbb
+static ProcessorState processor_bld_handler(Processor *p, Instruction *in) {
+    if (p->debug) printf_P(PSTR("bld r%d, %d\n"), in->d, in->r);
+    if (p->sreg.flags.t) {
+        bit_set(p->r[in->d], in->r);
+    } else {
+        bit_clear(p->r[in->d], in->r);
     }
+    return PROCESSOR_STATE_NORMAL;
+}
 
-    // asr Rd | 1001 010d dddd 0101
-    if ((i & 0b1111111000001111) == 0b1001010000000101) {
-        if (p->debug) printf_P(PSTR("asr r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        bool old_top_bit = bit(p->r[Rd], 7);
-        p->sreg.flags.c = bit(p->r[Rd], 0);
-        p->r[Rd] >>= 1;
-        if (old_top_bit) p->r[Rd] |= 1 << 7;
+// nop | sleep | wdr | spm
+// 0000 0000 0000 0000 | 1001 0101 1000 1000 | 1001 0101 1010 1000 | 1001 0101 1110 1000
+static ProcessorState processor_nop_handler(Processor *p, Instruction *in) {
+    (void)in;
+    if (p->debug) printf_P(PSTR("nop\n"));
+    return PROCESSOR_STATE_NORMAL;
+}
 
-        p->sreg.flags.n = bit(p->r[Rd], 7);
-        processor_flags(p, p->r[Rd], false, p->sreg.flags.n != p->sreg.flags.c);
-        return PROCESSOR_STATE_NORMAL;
+// break | 1001 0101 1001 1000
+static ProcessorState processor_break_handler(Processor *p, Instruction *in) {
+    (void)in;
+    if (p->debug) printf_P(PSTR("break\n"));
+    return PROCESSOR_STATE_BREAK;
+}
+
+static ProcessorState processor_unkown_handler(Processor *p, Instruction *in) {
+    (void)in;
+    printf_P(PSTR("Unkown instruction!\n"));
+    p->running = false;
+    return PROCESSOR_STATE_UNKOWN_INSTRUCTION;
+}
+
+// ###############################################################################
+// ############################# INSTRUCTION DECODING ############################
+// ###############################################################################
+
+// The operand layouts of the instruction encodings, the decoder uses them to
+// unpack the operands of an instruction word into an Instruction
+#define PROCESSOR_OPERANDS_NONE 0
+#define PROCESSOR_OPERANDS_RD_RR 1 // 0000 00rd dddd rrrr
+#define PROCESSOR_OPERANDS_RDW_RRW 2 // 0000 0000 dddd rrrr
+#define PROCESSOR_OPERANDS_RDU_K 3 // 0000 KKKK dddd KKKK
+#define PROCESSOR_OPERANDS_RDWP_K6 4 // 0000 0000 KKdd KKKK
+#define PROCESSOR_OPERANDS_RD 5 // 0000 000d dddd 0000
+#define PROCESSOR_OPERANDS_RD_B 6 // 0000 000d dddd 0bbb
+#define PROCESSOR_OPERANDS_RD_A 7 // 0000 0AAd dddd AAAA
+#define PROCESSOR_OPERANDS_AL_B 8 // 0000 0000 AAAA Abbb
+#define PROCESSOR_OPERANDS_K12 9 // 0000 kkkk kkkk kkkk
+#define PROCESSOR_OPERANDS_K7_S 10 // 0000 00kk kkkk ksss
+#define PROCESSOR_OPERANDS_S 11 // 0000 0000 0sss 0000
+#define PROCESSOR_OPERANDS_RDU_RRU 12 // 0000 0000 dddd rrrr
+#define PROCESSOR_OPERANDS_RDL_RRL 13 // 0000 0000 0ddd 0rrr
+#define PROCESSOR_OPERANDS_RD_Q 14 // 00q0 qq0d dddd 0qqq
+
+// Instructions that can change the program counter end a translated block
+#define PROCESSOR_OPCODE_BRANCH 0b00000001
+
+// Two word instructions get the second program word as their k operand
+#define PROCESSOR_OPCODE_LONG 0b00000010
+
+// The upper bits hold the instruction class for the profiler
+#define PROCESSOR_OPCODE_ARITHMETIC (PROCESSOR_CLASS_ARITHMETIC << 4)
+#define PROCESSOR_OPCODE_CONTROL (PROCESSOR_CLASS_BRANCH << 4)
+#define PROCESSOR_OPCODE_TRANSFER (PROCESSOR_CLASS_TRANSFER << 4)
+#define PROCESSOR_OPCODE_BIT (PROCESSOR_CLASS_BIT << 4)
+
+typedef struct ProcessorOpcode {
+    uint16_t mask;
+    uint16_t pattern;
+    uint8_t operands;
+    uint8_t cycles;
+    uint8_t flags;
+    ProcessorState (*handler)(Processor *p, Instruction *in);
+} ProcessorOpcode;
+
+// The instruction encodings in decode priority order, the first entry that
+// matches an instruction word wins and the last entry matches everything.
+// The cycles are the ATmega328p datasheet costs, the extra cycle of a taken
+// branch or skip is added by the handler
+const ProcessorOpcode processor_opcodes[] PROGMEM = {
+    // Arithmetic and logic instructions
+    { 0b1111110000000000, 0b0000110000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_add_handler },
+    { 0b1111110000000000, 0b0001110000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_adc_handler },
+    { 0b1111111100000000, 0b1001011000000000, PROCESSOR_OPERANDS_RDWP_K6, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_adiw_handler },
+    { 0b1111110000000000, 0b0001100000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_sub_handler },
+    { 0b1111110000000000, 0b0000100000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_sbc_handler },
+    { 0b1111000000000000, 0b0101000000000000, PROCESSOR_OPERANDS_RDU_K, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_subi_handler },
+    { 0b1111000000000000, 0b0100000000000000, PROCESSOR_OPERANDS_RDU_K, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_sbci_handler },
+    { 0b1111111100000000, 0b1001011100000000, PROCESSOR_OPERANDS_RDWP_K6, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_sbiw_handler },
+    { 0b1111110000000000, 0b0010000000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_and_handler },
+    { 0b1111000000000000, 0b0111000000000000, PROCESSOR_OPERANDS_RDU_K, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_andi_handler },
+    { 0b1111110000000000, 0b0010100000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_or_handler },
+    { 0b1111000000000000, 0b0110000000000000, PROCESSOR_OPERANDS_RDU_K, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_ori_handler },
+    { 0b1111110000000000, 0b0010010000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_eor_handler },
+    { 0b1111111000001111, 0b1001010000000000, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_com_handler },
+    { 0b1111111000001111, 0b1001010000000001, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_neg_handler },
+    { 0b1111111000001111, 0b1001010000000011, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_inc_handler },
+    { 0b1111111000001111, 0b1001010000001010, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_ARITHMETIC, &processor_dec_handler },
+    { 0b1111110000000000, 0b1001110000000000, PROCESSOR_OPERANDS_RD_RR, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_mul_handler },
+    { 0b1111111100000000, 0b0000001000000000, PROCESSOR_OPERANDS_RDU_RRU, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_muls_handler },
+    { 0b1111111110001000, 0b0000001100000000, PROCESSOR_OPERANDS_RDL_RRL, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_mulsu_handler },
+    { 0b1111111110001000, 0b0000001100001000, PROCESSOR_OPERANDS_RDL_RRL, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_fmul_handler },
+    { 0b1111111110001000, 0b0000001110000000, PROCESSOR_OPERANDS_RDL_RRL, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_fmuls_handler },
+    { 0b1111111110001000, 0b0000001110001000, PROCESSOR_OPERANDS_RDL_RRL, 2, PROCESSOR_OPCODE_ARITHMETIC, &processor_fmulsu_handler },
+
+    // Branch instructions
+    { 0b1111000000000000, 0b1100000000000000, PROCESSOR_OPERANDS_K12, 2, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_rjmp_handler },
+    { 0b1111111111111111, 0b1001010000001001, PROCESSOR_OPERANDS_NONE, 2, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_ijmp_handler },
+    { 0b1111111000001110, 0b1001010000001100, PROCESSOR_OPERANDS_NONE, 3, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH | PROCESSOR_OPCODE_LONG, &processor_jmp_handler },
+    { 0b1111000000000000, 0b1101000000000000, PROCESSOR_OPERANDS_K12, 3, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_rcall_handler },
+    { 0b1111111111111111, 0b1001010100001001, PROCESSOR_OPERANDS_NONE, 3, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_icall_handler },
+    { 0b1111111000001110, 0b1001010000001110, PROCESSOR_OPERANDS_NONE, 4, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH | PROCESSOR_OPCODE_LONG, &processor_call_handler },
+    { 0b1111111111111111, 0b1001010100001000, PROCESSOR_OPERANDS_NONE, 4, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_ret_handler },
+    { 0b1111111111111111, 0b1001010100011000, PROCESSOR_OPERANDS_NONE, 4, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_reti_handler },
+    { 0b1111110000000000, 0b0001000000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_cpse_handler },
+    { 0b1111110000000000, 0b0001010000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_CONTROL, &processor_cp_handler },
+    { 0b1111110000000000, 0b0000010000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_CONTROL, &processor_cpc_handler },
+    { 0b1111000000000000, 0b0011000000000000, PROCESSOR_OPERANDS_RDU_K, 1, PROCESSOR_OPCODE_CONTROL, &processor_cpi_handler },
+    { 0b1111111000001000, 0b1111111000000000, PROCESSOR_OPERANDS_RD_B, 1, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_sbrs_handler },
+    { 0b1111111000001000, 0b1111110000000000, PROCESSOR_OPERANDS_RD_B, 1, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_sbrc_handler },
+    { 0b1111111100000000, 0b1001101100000000, PROCESSOR_OPERANDS_AL_B, 1, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_sbis_handler },
+    { 0b1111111100000000, 0b1001100100000000, PROCESSOR_OPERANDS_AL_B, 1, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_sbic_handler },
+    { 0b1111110000000000, 0b1111000000000000, PROCESSOR_OPERANDS_K7_S, 1, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_brbs_handler },
+    { 0b1111110000000000, 0b1111010000000000, PROCESSOR_OPERANDS_K7_S, 1, PROCESSOR_OPCODE_CONTROL | PROCESSOR_OPCODE_BRANCH, &processor_brbc_handler },
+
+    // Data transfer instructions
+    { 0b1111110000000000, 0b0010110000000000, PROCESSOR_OPERANDS_RD_RR, 1, PROCESSOR_OPCODE_TRANSFER, &processor_mov_handler },
+    { 0b1111111100000000, 0b0000000100000000, PROCESSOR_OPERANDS_RDW_RRW, 1, PROCESSOR_OPCODE_TRANSFER, &processor_movw_handler },
+    { 0b1111000000000000, 0b1110000000000000, PROCESSOR_OPERANDS_RDU_K, 1, PROCESSOR_OPCODE_TRANSFER, &processor_ldi_handler },
+    { 0b1111111000001111, 0b1001000000001100, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_x_handler },
+    { 0b1111111000001111, 0b1001000000001101, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_x_increment_handler },
+    { 0b1111111000001111, 0b1001000000001110, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_x_decrement_handler },
+    { 0b1111111000001111, 0b1000000000001000, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_y_handler },
+    { 0b1111111000001111, 0b1001000000001001, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_y_increment_handler },
+    { 0b1111111000001111, 0b1001000000001010, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_y_decrement_handler },
+    { 0b1111111000001111, 0b1000000000000000, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_z_handler },
+    { 0b1111111000001111, 0b1001000000000001, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_z_increment_handler },
+    { 0b1111111000001111, 0b1001000000000010, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ld_z_decrement_handler },
+    { 0b1101001000001000, 0b1000000000001000, PROCESSOR_OPERANDS_RD_Q, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ldd_y_handler },
+    { 0b1101001000001000, 0b1000000000000000, PROCESSOR_OPERANDS_RD_Q, 2, PROCESSOR_OPCODE_TRANSFER, &processor_ldd_z_handler },
+    { 0b1111111000001111, 0b1001000000000000, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER | PROCESSOR_OPCODE_LONG, &processor_lds_handler },
+    { 0b1111111000001111, 0b1001001000001100, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_x_handler },
+    { 0b1111111000001111, 0b1001001000001101, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_x_increment_handler },
+    { 0b1111111000001111, 0b1001001000001110, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_x_decrement_handler },
+    { 0b1111111000001111, 0b1000001000001000, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_y_handler },
+    { 0b1111111000001111, 0b1001001000001001, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_y_increment_handler },
+    { 0b1111111000001111, 0b1001001000001010, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_y_decrement_handler },
+    { 0b1111111000001111, 0b1000001000000000, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_z_handler },
+    { 0b1111111000001111, 0b1001001000000001, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_z_increment_handler },
+    { 0b1111111000001111, 0b1001001000000010, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_st_z_decrement_handler },
+    { 0b1101001000001000, 0b1000001000001000, PROCESSOR_OPERANDS_RD_Q, 2, PROCESSOR_OPCODE_TRANSFER, &processor_std_y_handler },
+    { 0b1101001000001000, 0b1000001000000000, PROCESSOR_OPERANDS_RD_Q, 2, PROCESSOR_OPCODE_TRANSFER, &processor_std_z_handler },
+    { 0b1111111000001111, 0b1001001000000000, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER | PROCESSOR_OPCODE_LONG, &processor_sts_handler },
+    { 0b1111111111111111, 0b1001010111001000, PROCESSOR_OPERANDS_NONE, 3, PROCESSOR_OPCODE_TRANSFER, &processor_lpm_r0_handler },
+    { 0b1111111000001111, 0b1001000000000100, PROCESSOR_OPERANDS_RD, 3, PROCESSOR_OPCODE_TRANSFER, &processor_lpm_handler },
+    { 0b1111111000001111, 0b1001000000000101, PROCESSOR_OPERANDS_RD, 3, PROCESSOR_OPCODE_TRANSFER, &processor_lpm_increment_handler },
+    { 0b1111100000000000, 0b1011000000000000, PROCESSOR_OPERANDS_RD_A, 1, PROCESSOR_OPCODE_TRANSFER, &processor_in_handler },
+    { 0b1111100000000000, 0b1011100000000000, PROCESSOR_OPERANDS_RD_A, 1, PROCESSOR_OPCODE_TRANSFER, &processor_out_handler },
+    { 0b1111111000001111, 0b1001001000001111, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_push_handler },
+    { 0b1111111000001111, 0b1001000000001111, PROCESSOR_OPERANDS_RD, 2, PROCESSOR_OPCODE_TRANSFER, &processor_pop_handler },
+
+    // Bit and bit-test instructions
+    { 0b1111111100000000, 0b1001101000000000, PROCESSOR_OPERANDS_AL_B, 2, PROCESSOR_OPCODE_BIT, &processor_sbi_handler },
+    { 0b1111111100000000, 0b1001100000000000, PROCESSOR_OPERANDS_AL_B, 2, PROCESSOR_OPCODE_BIT, &processor_cbi_handler },
+    { 0b1111111000001111, 0b1001010000000110, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_BIT, &processor_lsr_handler },
+    { 0b1111111000001111, 0b1001010000000111, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_BIT, &processor_ror_handler },
+    { 0b1111111000001111, 0b1001010000000101, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_BIT, &processor_asr_handler },
+    { 0b1111111000001111, 0b1001010000000010, PROCESSOR_OPERANDS_RD, 1, PROCESSOR_OPCODE_BIT, &processor_swap_handler },
+    { 0b1111111110001111, 0b1001010000001000, PROCESSOR_OPERANDS_S, 1, PROCESSOR_OPCODE_BIT, &processor_bset_handler },
+    { 0b1111111110001111, 0b1001010010001000, PROCESSOR_OPERANDS_S, 1, PROCESSOR_OPCODE_BIT, &processor_bclr_handler },
+    { 0b1111111000001000, 0b1111101000000000, PROCESSOR_OPERANDS_RD_B, 1, PROCESSOR_OPCODE_BIT, &processor_bst_handler },
+    { 0b1111111000001000, 0b1111100000000000, PROCESSOR_OPERANDS_RD_B, 1, PROCESSOR_OPCODE_BIT, &processor_bld_handler },
+    { 0b1111111111111111, 0b0000000000000000, PROCESSOR_OPERANDS_NONE, 1, PROCESSOR_OPCODE_BIT, &processor_nop_handler },
+    { 0b1111111111111111, 0b1001010110001000, PROCESSOR_OPERANDS_NONE, 1, PROCESSOR_OPCODE_BIT, &processor_nop_handler },
+    { 0b1111111111111111, 0b1001010110101000, PROCESSOR_OPERANDS_NONE, 1, PROCESSOR_OPCODE_BIT, &processor_nop_handler },
+    { 0b1111111111111111, 0b1001010110011000, PROCESSOR_OPERANDS_NONE, 1, PROCESSOR_OPCODE_BIT | PROCESSOR_OPCODE_BRANCH, &processor_break_handler },
+    { 0b1111111111111111, 0b1001010111101000, PROCESSOR_OPERANDS_NONE, 1, PROCESSOR_OPCODE_BIT, &processor_nop_handler },
+
+    { 0b0000000000000000, 0b0000000000000000, PROCESSOR_OPERANDS_NONE, 1, PROCESSOR_OPCODE_BIT | PROCESSOR_OPCODE_BRANCH, &processor_unkown_handler }
+};
+
+#ifndef ARDUINO
+    // The opcode index of every possible instruction word, filled from the
+    // encodings above by processor_begin so decoding is a single lookup
+    uint8_t processor_decode_table[0x10000];
+#endif
+
+void processor_begin(void) {
+    #ifndef ARDUINO
+        uint16_t i = 0;
+        do {
+            uint8_t opcode = 0;
+            while ((i & processor_opcodes[opcode].mask) != processor_opcodes[opcode].pattern) opcode++;
+            processor_decode_table[i] = opcode;
+        } while (++i != 0);
+    #endif
+}
+
+void processor_decode(uint16_t i, Instruction *in) {
+    #ifdef ARDUINO
+        uint8_t opcode = 0;
+        while ((i & pgm_read_word(&processor_opcodes[opcode].mask)) != pgm_read_word(&processor_opcodes[opcode].pattern)) opcode++;
+    #else
+        uint8_t opcode = processor_decode_table[i];
+    #endif
+    in->opcode = opcode;
+    in->d = 0xff;
+
+    uint8_t operands = pgm_read_byte(&processor_opcodes[opcode].operands);
+    if (operands == PROCESSOR_OPERANDS_RD_RR) {
+        in->d = (i >> 4) & 0b11111;
+        in->r = (bit(i, 9) << 4) | (i & 0b1111);
+    } else if (operands == PROCESSOR_OPERANDS_RDW_RRW) {
+        in->d = ((i >> 4) & 0b1111) << 1;
+        in->r = (i & 0b1111) << 1;
+    } else if (operands == PROCESSOR_OPERANDS_RDU_K) {
+        in->d = ((i >> 4) & 0b1111) + 16;
+        in->k = ((i >> 4) & 0b11110000) | (i & 0b1111);
+    } else if (operands == PROCESSOR_OPERANDS_RDWP_K6) {
+        in->d = (((i >> 4) & 0b11) << 1) + 24;
+        in->k = ((i >> 2) & 0b110000) | (i & 0b1111);
+    } else if (operands == PROCESSOR_OPERANDS_RD) {
+        in->d = (i >> 4) & 0b11111;
+    } else if (operands == PROCESSOR_OPERANDS_RD_B) {
+        in->d = (i >> 4) & 0b11111;
+        in->r = i & 0b111;
+    } else if (operands == PROCESSOR_OPERANDS_RD_A) {
+        in->d = (i >> 4) & 0b11111;
+        in->k = ((i >> 5) & 0b110000) | (i & 0b1111);
+    } else if (operands == PROCESSOR_OPERANDS_AL_B) {
+        in->k = (i >> 3) & 0b11111;
+        in->r = i & 0b111;
+    } else if (operands == PROCESSOR_OPERANDS_K12) {
+        in->k = (i & 0b111111111111) << 1;
+        if (bit(in->k, 12)) in->k |= 0b1110000000000000;
+    } else if (operands == PROCESSOR_OPERANDS_K7_S) {
+        in->k = (i >> 2) & 0b11111110;
+        if (bit(in->k, 7)) in->k |= 0b1111111110000000;
+        in->r = i & 0b111;
+    } else if (operands == PROCESSOR_OPERANDS_S) {
+        in->r = (i >> 4) & 0b111;
+    } else if (operands == PROCESSOR_OPERANDS_RDU_RRU) {
+        in->d = ((i >> 4) & 0b1111) + 16;
+        in->r = (i & 0b1111) + 16;
+    } else if (operands == PROCESSOR_OPERANDS_RDL_RRL) {
+        in->d = ((i >> 4) & 0b111) + 16;
+        in->r = (i & 0b111) + 16;
+    } else if (operands == PROCESSOR_OPERANDS_RD_Q) {
+        in->d = (i >> 4) & 0b11111;
+        in->k = ((i >> 8) & 0b100000) | ((i >> 7) & 0b11000) | (i & 0b111);
     }
+}
 
-    // swap Rd | 1001 010d dddd 0010
-    if ((i & 0b1111111000001111) == 0b1001010000000010) {
-        if (p->debug) printf_P(PSTR("Execute: swap r%d (0x%02x)\n"), Rd, p->r[Rd]);
-        p->r[Rd] = ((p->r[Rd] & 0b1111) << 4) | (p->r[Rd] >> 4);
-        return PROCESSOR_STATE_NORMAL;
+// Decodes the instruction at a program address, the second word of a two
+// word instruction is read as its k operand, returns the first word. The
+// program is read from the EEPROM, see processes_invalidate for the syncs
+static uint16_t processor_fetch(Processor *p, uint16_t pc, Instruction *in) {
+    uint16_t word = eeprom_read_word(p->pgm_address + pc);
+    processor_decode(word, in);
+    if ((pgm_read_byte(&processor_opcodes[in->opcode].flags) & PROCESSOR_OPCODE_LONG) != 0) {
+        in->k = eeprom_read_word(p->pgm_address + pc + 2);
     }
+    return word;
+}
 
-    // bset s | bclr s | 1001 0100 xsss 1000
-    if ((i & 0b1111111100001111) == 0b1001010000001000) {
-        uint8_t set = bit(i, 7) == 0;
-        if (p->debug) printf_P(PSTR("%" PRIpstr " %d\n"), set ? PSTR("bset") : PSTR("bclr"), s);
-        if (set) {
-            bit_set(p->sreg.data, s);
-        } else {
-            bit_clear(p->sreg.data, s);
+ProcessorState processor_execute(Processor *p, Instruction *in) {
+    return ((ProcessorState (*)(Processor *p, Instruction *in))pgm_read_word(&processor_opcodes[in->opcode].handler))(p, in);
+}
+
+#ifndef ARDUINO
+    // Returns the decoded instruction at a program address from the image,
+    // when the image has no slot for it yet it is decoded into the buffer
+    static Instruction *processor_image_fetch(Processor *p, uint16_t pc, Instruction *buffer) {
+        uint16_t index = pc >> 1;
+        if (p->image != NULL && index < PROCESSOR_IMAGE_SIZE) {
+            uint8_t *decoded = &p->image->decoded[index];
+            Instruction *in = &p->image->instructions[index];
+            if (__atomic_load_n(decoded, __ATOMIC_ACQUIRE) == PROCESSOR_IMAGE_READY) return in;
+            uint8_t empty = PROCESSOR_IMAGE_EMPTY;
+            if (__atomic_compare_exchange_n(decoded, &empty, PROCESSOR_IMAGE_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                processor_fetch(p, pc, in);
+                __atomic_store_n(decoded, PROCESSOR_IMAGE_READY, __ATOMIC_RELEASE);
+                return in;
+            }
         }
-        return PROCESSOR_STATE_NORMAL;
+        processor_fetch(p, pc, buffer);
+        return buffer;
+    }
+
+    static void processor_translate(Processor *p, ProcessorBlock *block) {
+        block->size = 0;
+        block->cycles = 0;
+        uint16_t pc = p->pc;
+        uint8_t flags;
+        do {
+            ProcessorOperation *operation = &block->operations[block->size++];
+            operation->in = *processor_image_fetch(p, pc, &operation->in);
+            operation->handler = processor_opcodes[operation->in.opcode].handler;
+            block->cycles += processor_opcodes[operation->in.opcode].cycles;
+            flags = processor_opcodes[operation->in.opcode].flags;
+            pc += (flags & PROCESSOR_OPCODE_LONG) != 0 ? 4 : 2;
+        } while ((flags & PROCESSOR_OPCODE_BRANCH) == 0 && block->size < PROCESSOR_BLOCK_SIZE && !(pc >= 2 && pc <= PROCESSOR_SYSCALL_LAST));
+    }
+
+    // Returns the translated block that starts at the program counter, a
+    // block that an other processor is translating is not waited for and
+    // NULL is returned, like when the pool has no blocks left
+    static ProcessorBlock *processor_block(Processor *p) {
+        uint16_t index = p->pc >> 1;
+        if (p->image == NULL || index >= PROCESSOR_IMAGE_SIZE) return NULL;
+        uint16_t *slot = &p->image->block_index[index];
+        uint16_t block = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (block < PROCESSOR_BLOCKS_SIZE) return &p->image->blocks[block];
+
+        uint16_t empty = PROCESSOR_BLOCK_EMPTY;
+        if (block != PROCESSOR_BLOCK_EMPTY ||
+            !__atomic_compare_exchange_n(slot, &empty, PROCESSOR_BLOCK_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+        ) {
+            return NULL;
+        }
+        block = __atomic_fetch_add(&p->image->blocks_size, 1, __ATOMIC_RELAXED);
+        if (block >= PROCESSOR_BLOCKS_SIZE) {
+            __atomic_store_n(slot, PROCESSOR_BLOCK_NONE, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        processor_translate(p, &p->image->blocks[block]);
+        __atomic_store_n(slot, block, __ATOMIC_RELEASE);
+        return &p->image->blocks[block];
+    }
+
+    static ProcessorState processor_run_block(Processor *p, ProcessorBlock *block) {
+        p->cycles += block->cycles;
+        p->instructions += block->size;
+        ProcessorState state = PROCESSOR_STATE_NORMAL;
+        for (uint8_t i = 0; i < block->size; i++) {
+            p->pc += 2;
+            state = block->operations[i].handler(p, &block->operations[i].in);
+        }
+        return state;
     }
+#endif
 
-    // bst Rd, b | 1111 101d dddd 0bbb
-    if ((i & 0b1111111000001000) == 0b1111101000000000) {
-        if (p->debug) printf_P(PSTR("bst r%d, %d\n"), Rd, b);
-        p->sreg.flags.t = bit(p->r[Rd], b);
-        return PROCESSOR_STATE_NORMAL;
-    }
+static ProcessorState processor_step(Processor *p) {
+    #ifndef ARDUINO
+        if (p->jit && !p->trace && !p->profile) {
+            ProcessorBlock *block = processor_block(p);
+            if (block != NULL) return processor_run_block(p, block);
+        }
+    #endif
 
-    // bld Rd, b | 1111 100d dddd 0bbb
-    if ((i & 0b1111111000001000) == 0b1111100000000000) {
-        if (p->debug) printf_P(PSTR("bld r%d, %d\n"), Rd, b);
-        if (p->sreg.flags.t) {
-            bit_set(p->r[Rd], b);
+    // Program words are only fetched from the EEPROM and decoded the first
+    // time they are executed, after that they come from the program image
+    Instruction decoded;
+    Instruction *in = &decoded;
+    ProcessorTrace *trace = NULL;
+    #ifdef ARDUINO
+        uint16_t word = processor_fetch(p, p->pc, in);
+        if (p->trace) trace = processor_trace_begin(p, word, 0);
+    #else
+        // The image does not keep the program words, so a traced step
+        // fetches its instruction to store the word in the trace
+        if (p->trace) {
+            trace = processor_trace_begin(p, processor_fetch(p, p->pc, in), 0);
         } else {
-            bit_clear(p->r[Rd], b);
+            in = processor_image_fetch(p, p->pc, &decoded);
         }
-        return PROCESSOR_STATE_NORMAL;
+        if (p->profile) processor_profile_count(p->pc, processor_opcodes[in->opcode].flags >> 4);
+    #endif
+
+    p->pc += 2;
+    p->cycles += pgm_read_byte(&processor_opcodes[in->opcode].cycles);
+    p->instructions++;
+    ProcessorState state = processor_execute(p, in);
+
+    if (trace != NULL && in->d < 32) {
+        trace->reg = in->d;
+        trace->reg_data = p->r[in->d];
     }
+    return state;
+}
 
-    // nop | sleep | wdr | break | spm
-    // 0000 0000 0000 0000 | 1001 0101 1000 1000 | 1001 0101 1010 1000 | 1001 0101 1001 1000 | 1001 0101 1110 1000
-    if (i == 0b0000000000000000 || i == 0b1001010110001000 || i == 0b1001010110101000 || i == 0b1001010110011000|| i == 0b1001010111101000) {
-        printf_P(PSTR("nop\n"));
-        return PROCESSOR_STATE_NORMAL;
+ProcessorState processor_run(Processor *p, uint32_t max_cycles) {
+    uint32_t start_cycles = p->cycles;
+    while (p->running) {
+        // The syscall vectors are handled by the caller, so the kernel code
+        // they run is not part of the execution loop
+        uint16_t pc = p->pc;
+        if (pc >= 2 && pc <= PROCESSOR_SYSCALL_LAST) return PROCESSOR_STATE_SYSCALL;
+
+        ProcessorState state = processor_step(p);
+        if (state == PROCESSOR_STATE_BREAK || state == PROCESSOR_STATE_UNKOWN_INSTRUCTION) return state;
+        if (p->cycles - start_cycles >= max_cycles) return p->running ? state : PROCESSOR_STATE_HALTED;
     }
+    return PROCESSOR_STATE_HALTED;
+}
 
-    printf_P(PSTR("Unkown instruction!\n"));
-    p->running = false;
-    return PROCESSOR_STATE_UNKOWN_INSTRUCTION;
+ProcessorState processor_clock(Processor *p) {
+    ProcessorState state = processor_run(p, 1);
+    if (state == PROCESSOR_STATE_SYSCALL) return processor_syscall(p);
+    return state;
 }
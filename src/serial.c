@@ -74,6 +74,7 @@ void serial_begin(void) {
             serial_input_write_position = 0;
         }
         serial_input_buffer[serial_input_write_position++] = character;
+        processes_event(PROCESSOR_EVENT_SERIAL);
     }
 #else
     void serial_read_input(void) {
@@ -91,6 +92,7 @@ void serial_begin(void) {
                             serial_input_write_position = 0;
                         }
                         serial_input_buffer[serial_input_write_position++] = character;
+                        processes_event(PROCESSOR_EVENT_SERIAL);
                         break;
                     }
                 }